@@ -0,0 +1,323 @@
+/* Benchmark the pool allocator.
+ * By Richard W.M. Jones <rich@annexia.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include <pool.h>
+#include <vector.h>
+
+static double
+now ()
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Measure the cost of prealloc on a large, growing block (such as a
+ * string being appended to) in a pool which already owns n other
+ * allocations. This should not depend on n.
+ */
+static void
+prealloc_bench (int n)
+{
+  const int nr_reallocs = 100000;
+  pool p = new_pool ();
+  char *str;
+  double start, elapsed;
+  int i;
+
+  for (i = 0; i < n; ++i)
+    pool_register_malloc (p, malloc (1));
+
+  str = pmalloc (p, 8192);
+  start = now ();
+  for (i = 0; i < nr_reallocs; ++i)
+    {
+      str = prealloc (p, str, 8192 + i * 16);
+      str[8191 + i * 16] = 0;
+    }
+  elapsed = now () - start;
+
+  printf ("prealloc: %8d allocations in pool: %8.1f ns per prealloc\n",
+	  n, elapsed * 1e9 / nr_reallocs);
+
+  delete_pool (p);
+}
+
+/* Measure the throughput of small allocations when nr_threads threads
+ * allocate from the same concurrent pool.
+ */
+#define ALLOCS_PER_THREAD 1000000
+
+static void *
+concurrent_worker (void *vp)
+{
+  pool p = (pool) vp;
+  int i;
+
+  for (i = 0; i < ALLOCS_PER_THREAD; ++i)
+    pmalloc (p, 8 + (i & 63));
+
+  return 0;
+}
+
+static void
+concurrent_bench (int nr_threads)
+{
+  pool p = new_pool ();
+  pthread_t threads[nr_threads];
+  double start, elapsed;
+  int i;
+
+  pool_set_flags (p, POOL_CONCURRENT);
+
+  start = now ();
+  for (i = 0; i < nr_threads; ++i)
+    pthread_create (&threads[i], 0, concurrent_worker, p);
+  for (i = 0; i < nr_threads; ++i)
+    pthread_join (threads[i], 0);
+  elapsed = now () - start;
+
+  printf ("concurrent pmalloc: %2d threads: %8.1f million allocations/s\n",
+	  nr_threads, nr_threads * ALLOCS_PER_THREAD / elapsed / 1e6);
+
+  delete_pool (p);
+}
+
+/* Compare two ways of backing off speculative work: allocating in a
+ * throwaway subpool, and releasing the pool to a mark.
+ */
+#define NR_ATTEMPTS 1000000
+
+static void
+speculate_bench ()
+{
+  pool p = new_pool (), sp;
+  struct pool_mark mark;
+  double start, subpool_time, mark_time;
+  int i, j;
+
+  start = now ();
+  for (i = 0; i < NR_ATTEMPTS; ++i)
+    {
+      sp = new_subpool (p);
+      for (j = 0; j < 8; ++j)
+	pmalloc (sp, 16 + j * 8);
+      delete_pool (sp);
+    }
+  subpool_time = now () - start;
+
+  start = now ();
+  for (i = 0; i < NR_ATTEMPTS; ++i)
+    {
+      pool_mark (p, &mark);
+      for (j = 0; j < 8; ++j)
+	pmalloc (p, 16 + j * 8);
+      pool_release_to_mark (p, &mark);
+    }
+  mark_time = now () - start;
+
+  printf ("speculate: subpool: %6.1f ns per attempt  mark/release: "
+	  "%6.1f ns per attempt\n",
+	  subpool_time * 1e9 / NR_ATTEMPTS, mark_time * 1e9 / NR_ATTEMPTS);
+
+  delete_pool (p);
+}
+
+/* Fill a pool with small blocks, then follow a random chain through
+ * them, which is dominated by cache and TLB misses. Compare the
+ * default malloc'd chunks with mmap'd chunks and huge pages.
+ */
+#define NR_BLOCKS (2 * 1024 * 1024)
+
+static void
+mapped_bench (int flags, const char *name)
+{
+  pool p = new_pool ();
+  void ***blocks;
+  void **b;
+  double start, fill, scan, del;
+  int i, j;
+
+  pool_set_flags (p, flags);
+  blocks = malloc (NR_BLOCKS * sizeof (void **));
+
+  start = now ();
+  for (i = 0; i < NR_BLOCKS; ++i)
+    blocks[i] = pmalloc (p, 48);
+  fill = now () - start;
+
+  /* Link the blocks into one random cycle. */
+  for (i = 0; i < NR_BLOCKS; ++i)
+    {
+      j = i + random () % (NR_BLOCKS - i);
+      b = blocks[i]; blocks[i] = blocks[j]; blocks[j] = b;
+    }
+  for (i = 0; i < NR_BLOCKS; ++i)
+    *blocks[i] = blocks[(i + 1) % NR_BLOCKS];
+
+  start = now ();
+  for (i = 0, b = blocks[0]; i < NR_BLOCKS; ++i)
+    b = *b;
+  scan = now () - start;
+  if (b != blocks[0])
+    abort ();
+
+  start = now ();
+  delete_pool (p);
+  del = now () - start;
+
+  printf ("%-15s fill: %6.1f ns/block  random walk: %6.1f ns/block  "
+	  "delete: %6.2f ms\n",
+	  name, fill * 1e9 / NR_BLOCKS, scan * 1e9 / NR_BLOCKS, del * 1e3);
+
+  free (blocks);
+}
+
+static int
+node_exists (int node)
+{
+  char filename[64];
+
+  sprintf (filename, "/sys/devices/system/node/node%d", node);
+  return access (filename, F_OK) == 0;
+}
+
+/* Run this thread only on the CPUs of a NUMA node. Returns -1 if the
+ * node does not exist.
+ */
+static int
+run_on_node (int node)
+{
+  char filename[64], list[1024], *p;
+  cpu_set_t cpus;
+  FILE *fp;
+  int first, last;
+
+  sprintf (filename, "/sys/devices/system/node/node%d/cpulist", node);
+  fp = fopen (filename, "r");
+  if (fp == 0)
+    return -1;
+  if (fgets (list, sizeof list, fp) == 0)
+    list[0] = 0;
+  fclose (fp);
+
+  /* The list looks like "0-3,8-11". */
+  CPU_ZERO (&cpus);
+  for (p = list; *p >= '0' && *p <= '9'; )
+    {
+      first = last = strtol (p, &p, 10);
+      if (*p == '-')
+	last = strtol (p + 1, &p, 10);
+      for (; first <= last; ++first)
+	CPU_SET (first, &cpus);
+      if (*p == ',')
+	p++;
+    }
+
+  return sched_setaffinity (0, sizeof cpus, &cpus);
+}
+
+/* Scan a large vector of ints from a thread on node 0, when the
+ * vector was allocated in a pool placed on node 0 and on another node.
+ * On a machine with one node, only the local case is measured.
+ */
+#define NUMA_VECTOR_SIZE (64 * 1024 * 1024)
+
+static void
+numa_bench ()
+{
+  int nodes[2] = { 0, -1 };
+  int i, j, k, zero = 0;
+  const int *ints;
+  long sum;
+  double start, elapsed;
+  pool p;
+  vector v;
+
+  if (run_on_node (0) == -1)
+    {
+      printf ("numa: no NUMA information available\n");
+      return;
+    }
+  for (i = 1; node_exists (i); ++i)
+    nodes[1] = i;
+
+  for (i = 0; i < 2 && nodes[i] >= 0; ++i)
+    {
+      p = new_pool ();
+      if (pool_set_numa_node (p, nodes[i]) == -1)
+	{
+	  perror ("pool_set_numa_node");
+	  delete_pool (p);
+	  return;
+	}
+      v = new_vector (p, int);
+      vector_reallocate (v, NUMA_VECTOR_SIZE);
+      vector_fill (v, zero, NUMA_VECTOR_SIZE);
+
+      start = now ();
+      for (k = 0, sum = 0; k < 4; ++k)
+	{
+	  vector_get_ptr (v, 0, ints);
+	  for (j = 0; j < NUMA_VECTOR_SIZE; ++j)
+	    sum += ints[j];
+	}
+      elapsed = now () - start;
+      if (sum != 0)
+	abort ();
+
+      printf ("numa: scan from node 0 of vector on node %d (%s): "
+	      "%6.2f GB/s\n", nodes[i], i == 0 ? "local" : "remote",
+	      4.0 * NUMA_VECTOR_SIZE * sizeof (int) / elapsed / 1e9);
+
+      delete_pool (p);
+    }
+}
+
+int
+main ()
+{
+  int n;
+
+  for (n = 1000; n <= 1000000; n *= 10)
+    prealloc_bench (n);
+
+  for (n = 1; n <= 8; n *= 2)
+    concurrent_bench (n);
+
+  speculate_bench ();
+
+  mapped_bench (0, "malloc chunks:");
+  mapped_bench (POOL_MMAP, "POOL_MMAP:");
+  mapped_bench (POOL_HUGEPAGES, "POOL_HUGEPAGES:");
+
+  numa_bench ();
+
+  exit (0);
+}
@@ -0,0 +1,384 @@
+/* Benchmark vectors.
+ * By Richard W.M. Jones <rich@annexia.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <pool.h>
+#include <vector.h>
+#include <pstring.h>
+
+static double
+now ()
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Insert and then erase single elements at position n * where / 2
+ * (so where == 0 is the front and where == 1 the middle) of a vector
+ * of n ints. In the middle each operation moves half the vector.
+ */
+static void
+insert_bench (int n, int where)
+{
+  pool p = new_pool ();
+  vector v = new_vector (p, int);
+  double start, elapsed;
+  int i, k, x, nr_ops;
+
+  for (i = 0; i < n; ++i)
+    vector_push_back (v, i);
+
+  /* About 1 GB of memory moved per test in the middle. */
+  nr_ops = 250000000 / n;
+  if (nr_ops < 10) nr_ops = 10;
+  if (nr_ops > 1000000) nr_ops = 1000000;
+
+  k = n * where / 2;
+  start = now ();
+  for (i = 0; i < nr_ops; ++i)
+    {
+      vector_insert (v, k, i);
+      vector_erase (v, k);
+    }
+  elapsed = now () - start;
+
+  vector_get (v, n-1, x);
+  if (vector_size (v) != n || x != n-1)
+    abort ();
+
+  printf ("vector: insert+erase at %-6s of %8d ints: %10.1f ns/op\n",
+	  where ? "middle" : "front", n, elapsed / nr_ops * 1e9);
+
+  delete_pool (p);
+}
+
+/* Use a vector as a queue: push on the back and pop from the front. */
+static void
+queue_bench (int n)
+{
+  pool p = new_pool ();
+  vector v = new_vector (p, int);
+  double start, elapsed;
+  int i, x, nr_ops;
+
+  for (i = 0; i < n; ++i)
+    vector_push_back (v, i);
+
+  nr_ops = 250000000 / n;
+  if (nr_ops < 10) nr_ops = 10;
+  if (nr_ops > 1000000) nr_ops = 1000000;
+
+  start = now ();
+  for (i = 0; i < nr_ops; ++i)
+    {
+      vector_pop_front (v, x);
+      vector_push_back (v, x);
+    }
+  elapsed = now () - start;
+
+  if (vector_size (v) != n)
+    abort ();
+
+  printf ("vector: pop_front+push_back on %8d ints: %10.1f ns/op\n",
+	  n, elapsed / nr_ops * 1e9);
+
+  delete_pool (p);
+}
+
+/* Compare the generic element functions with the typed inline ones,
+ * building and summing a vector of n ints.
+ */
+static void
+typed_bench (int n)
+{
+  pool p = new_pool ();
+  vector v;
+  double start, push_generic, push_typed, get_generic, get_typed;
+  long sum1 = 0, sum2 = 0;
+  int i, x;
+
+  v = new_vector (p, int);
+  start = now ();
+  for (i = 0; i < n; ++i)
+    vector_push_back (v, i);
+  push_generic = now () - start;
+
+  start = now ();
+  for (i = 0; i < n; ++i)
+    {
+      vector_get (v, i, x);
+      sum1 += x;
+    }
+  get_generic = now () - start;
+
+  v = new_vector (p, int);
+  start = now ();
+  for (i = 0; i < n; ++i)
+    vector_int_push_back (v, i);
+  push_typed = now () - start;
+
+  start = now ();
+  for (i = 0; i < n; ++i)
+    sum2 += vector_int_get (v, i);
+  get_typed = now () - start;
+
+  if (sum1 != sum2)
+    abort ();
+
+  printf ("vector: push_back %d ints: generic %5.2f ns, typed %5.2f ns\n",
+	  n, push_generic / n * 1e9, push_typed / n * 1e9);
+  printf ("vector: get %d ints: generic %5.2f ns, typed %5.2f ns\n",
+	  n, get_generic / n * 1e9, get_typed / n * 1e9);
+
+  delete_pool (p);
+}
+
+static int
+cmp_int (const int *a, const int *b)
+{
+  return *a < *b ? -1 : *a > *b;
+}
+
+static int
+cmp_float (const float *a, const float *b)
+{
+  return *a < *b ? -1 : *a > *b;
+}
+
+static int
+cmp_str (const char **a, const char **b)
+{
+  return strcmp (*a, *b);
+}
+
+#define int_less(a,b) ((a) < (b))
+VECTOR_DEFINE_SORT (bench_int, int, int_less)
+
+/* Time one sort of a copy of v, and check the result is sorted. */
+static void
+time_sort (vector v, const char *type, const char *name,
+	   void (*sort_fn) (vector), int (*compare_fn) (const void *, const void *))
+{
+  pool p = new_subpool (v->pool);
+  vector w = copy_vector (p, v);
+  double start, elapsed;
+  int i;
+
+  start = now ();
+  sort_fn (w);
+  elapsed = now () - start;
+
+  for (i = 1; i < vector_size (w); ++i)
+    if (compare_fn (_vector_get_ptr (w, i-1), _vector_get_ptr (w, i)) > 0)
+      abort ();
+
+  printf ("vector: sort %d %s with %-12s %8.1f ms\n",
+	  vector_size (w), type, name, elapsed * 1e3);
+
+  delete_pool (p);
+}
+
+static void qsort_int (vector v) { vector_sort (v, cmp_int); }
+static void qsort_float (vector v) { vector_sort (v, cmp_float); }
+static void qsort_str (vector v) { psort (v, cmp_str); }
+static void stable_int (vector v) { vector_stable_sort (v, cmp_int); }
+static void intro_int (vector v) { vector_bench_int_sort (v); }
+
+static void
+sort_bench (int n)
+{
+  pool p = new_pool ();
+  vector ints = new_vector (p, int);
+  vector floats = new_vector (p, float);
+  vector strs = new_vector (p, char *);
+  int i;
+
+  srand (1);
+  for (i = 0; i < n; ++i)
+    {
+      vector_int_push_back (ints, rand () - RAND_MAX / 2);
+      vector_float_push_back (floats, (rand () - RAND_MAX / 2) / 1e3f);
+    }
+  for (i = 0; i < n / 10; ++i)
+    vector_ptr_push_back (strs, pitoa (p, rand ()));
+
+#define CMP (int (*) (const void *, const void *))
+  time_sort (ints, "ints", "qsort", qsort_int, CMP cmp_int);
+  time_sort (ints, "ints", "stable", stable_int, CMP cmp_int);
+  time_sort (ints, "ints", "introsort", intro_int, CMP cmp_int);
+  time_sort (ints, "ints", "radix", vector_int_sort, CMP cmp_int);
+  time_sort (floats, "floats", "qsort", qsort_float, CMP cmp_float);
+  time_sort (floats, "floats", "radix", vector_float_sort, CMP cmp_float);
+  time_sort (strs, "strings", "psort", qsort_str, CMP cmp_str);
+  time_sort (strs, "strings", "str_sort", vector_str_sort, CMP cmp_str);
+#undef CMP
+
+  delete_pool (p);
+}
+
+static void
+slow_sqrt (const double *a, double *r)
+{
+  int i;
+
+  *r = *a;
+  for (i = 0; i < 20; ++i)
+    *r = (*r + *a / *r) / 2;
+}
+
+static int
+is_odd (const int *a)
+{
+  return *a & 1;
+}
+
+/* Compare map and grep with their parallel versions using 1 to 8
+ * threads.
+ */
+static void
+parallel_bench (int n)
+{
+  pool p = new_pool ();
+  vector doubles = new_vector (p, double), ints = new_vector (p, int), r;
+  struct pool_mark mark;
+  double start, elapsed;
+  int i, t;
+
+  for (i = 0; i < n; ++i)
+    {
+      vector_double_push_back (doubles, i + 1);
+      vector_int_push_back (ints, rand ());
+    }
+
+  start = now ();
+  vector_map (p, doubles, (void (*) (const void *, void *)) slow_sqrt, double);
+  elapsed = now () - start;
+  printf ("vector: map %d doubles sequential: %8.1f ms\n",
+	  n, elapsed * 1e3);
+  for (t = 1; t <= 8; t *= 2)
+    {
+      vector_set_threads (t);
+      start = now ();
+      r = vector_map_parallel (p, doubles,
+			       (void (*) (const void *, void *)) slow_sqrt,
+			       double);
+      elapsed = now () - start;
+      if (vector_double_get (r, 3) != 2)
+	abort ();
+      printf ("vector: map %d doubles %d thread(s): %8.1f ms\n",
+	      n, t, elapsed * 1e3);
+    }
+
+  start = now ();
+  vector_grep (p, ints, (int (*) (const void *)) is_odd);
+  elapsed = now () - start;
+  printf ("vector: grep %d ints sequential: %8.1f ms\n", n, elapsed * 1e3);
+  for (t = 1; t <= 8; t *= 2)
+    {
+      vector_set_threads (t);
+      start = now ();
+      vector_grep_parallel (p, ints, (int (*) (const void *)) is_odd);
+      elapsed = now () - start;
+      printf ("vector: grep %d ints %d thread(s): %8.1f ms\n",
+	      n, t, elapsed * 1e3);
+    }
+
+  /* Many calls on a medium-sized vector, where starting threads for
+   * each call would cost more than the work.
+   */
+  ints = new_subvector (p, ints, 0, 65536);
+  for (t = 1; t <= 8; t *= 2)
+    {
+      vector_set_threads (t);
+      start = now ();
+      for (i = 0; i < 1000; ++i)
+	{
+	  pool_mark (p, &mark);
+	  vector_grep_parallel (p, ints, (int (*) (const void *)) is_odd);
+	  pool_release_to_mark (p, &mark);
+	}
+      elapsed = now () - start;
+      printf ("vector: grep 65536 ints x 1000 %d thread(s): %8.1f us/call\n",
+	      t, elapsed * 1e3);
+    }
+  vector_set_threads (0);
+
+  delete_pool (p);
+}
+
+/* Build n vectors of 2 ints, with and without inline storage. */
+static void
+small_bench (int n)
+{
+  struct pool_stats stats;
+  double start, elapsed;
+  pool p;
+  vector v;
+  int i, inline_n;
+
+  for (inline_n = 0; inline_n <= 4; inline_n += 4)
+    {
+      p = new_pool ();
+      start = now ();
+      for (i = 0; i < n; ++i)
+	{
+	  v = inline_n ? new_vector_inline (p, int, inline_n)
+	    : new_vector (p, int);
+	  vector_int_push_back (v, i);
+	  vector_int_push_back (v, i);
+	}
+      elapsed = now () - start;
+      pool_get_stats (p, &stats, sizeof stats);
+
+      printf ("vector: %d vectors of 2 ints, %d inline: %6.1f ns, "
+	      "%5.1f bytes each\n", n, inline_n, elapsed / n * 1e9,
+	      (double) stats.bytes_reserved / n);
+      delete_pool (p);
+    }
+}
+
+int
+main ()
+{
+  int n;
+
+  for (n = 1000; n <= 10000000; n *= 100)
+    {
+      insert_bench (n, 0);
+      insert_bench (n, 1);
+      queue_bench (n);
+    }
+
+  typed_bench (10000000);
+
+  small_bench (1000000);
+
+  sort_bench (10000000);
+
+  parallel_bench (10000000);
+
+  exit (0);
+}
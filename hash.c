@@ -51,6 +51,11 @@ struct shash
 
 #define HASH_NR_BUCKETS 32
 
+/* Entries stored inside each bucket's vector before it needs a
+ * separate allocation. Most buckets hold only a few.
+ */
+#define BUCKET_INLINE 4
+
 /* This is the hashing function -- the same one as used by Perl. */
 static inline unsigned
 HASH (const void *key, size_t key_size, int nr_buckets)
@@ -183,7 +188,8 @@ _hash_insert (hash h, const void *key, const void *value)
   /* If there is no bucket there, we have to allocate a fresh vector. */
   if (bucket == 0)
     {
-      bucket = new_vector (h->pool, struct hash_bucket_entry);
+      bucket = new_vector_inline (h->pool, struct hash_bucket_entry,
+				   BUCKET_INLINE);
       vector_replace (h->buckets, b, bucket);
     }
 
@@ -230,8 +236,10 @@ _hash_erase (hash h, const void *key)
       vector_get (bucket, i, entry);
       if (memcmp (entry.key, key, h->key_size) == 0)
 	{
-	  /* Remove this entry. */
+	  /* Remove this entry and let the pool reuse its memory. */
 	  vector_erase (bucket, i);
+	  pfree (h->pool, entry.key);
+	  pfree (h->pool, entry.value);
 
 	  return 1;
 	}
@@ -462,7 +470,8 @@ sash_insert (sash h, const char *key, const char *value)
   /* If there is no bucket there, we have to allocate a fresh vector. */
   if (bucket == 0)
     {
-      bucket = new_vector (h->pool, struct sash_bucket_entry);
+      bucket = new_vector_inline (h->pool, struct sash_bucket_entry,
+				   BUCKET_INLINE);
       vector_replace (h->buckets, b, bucket);
     }
 
@@ -521,8 +530,10 @@ sash_erase (sash h, const char *key)
       vector_get (bucket, i, entry);
       if (strcmp (entry.key, key) == 0)
 	{
-	  /* Remove this entry. */
+	  /* Remove this entry and let the pool reuse its memory. */
 	  vector_erase (bucket, i);
+	  pfree (h->pool, entry.key);
+	  pfree (h->pool, entry.value);
 
 	  return 1;
 	}
@@ -765,7 +776,8 @@ _shash_insert (shash h, const char *key, const void *value)
   /* If there is no bucket there, we have to allocate a fresh vector. */
   if (bucket == 0)
     {
-      bucket = new_vector (h->pool, struct shash_bucket_entry);
+      bucket = new_vector_inline (h->pool, struct shash_bucket_entry,
+				   BUCKET_INLINE);
       vector_replace (h->buckets, b, bucket);
     }
 
@@ -812,8 +824,10 @@ shash_erase (shash h, const char *key)
       vector_get (bucket, i, entry);
       if (strcmp (entry.key, key) == 0)
 	{
-	  /* Remove this entry. */
+	  /* Remove this entry and let the pool reuse its memory. */
 	  vector_erase (bucket, i);
+	  pfree (h->pool, entry.key);
+	  pfree (h->pool, entry.value);
 
 	  return 1;
 	}
@@ -111,6 +111,10 @@ extern int _hash_insert (hash, const void *key, const void *value);
  *
  * Erase @code{key} from the hash. If an element was erased,
  * this returns true, else this returns false.
+ *
+ * The memory used by the erased key and value is released back to
+ * the pool (see @ref{pfree(3)}), so any pointers previously obtained
+ * to them must not be used afterwards.
  */
 #define hash_erase(h,key) _hash_erase((h),&(key))
 extern int _hash_erase (hash, const void *key);
@@ -205,6 +209,10 @@ extern int sash_insert (sash, const char *key, const char *value);
  *
  * Erase @code{key} from the sash. If an element was erased,
  * this returns true, else this returns false.
+ *
+ * The memory used by the erased key and value is released back to
+ * the pool (see @ref{pfree(3)}), so any pointers previously obtained
+ * to them must not be used afterwards.
  */
 extern int sash_erase (sash, const char *key);
 
@@ -311,6 +319,10 @@ extern int _shash_insert (shash, const char *key, const void *value);
  *
  * Erase @code{key} from the shash. If an element was erased,
  * this returns true, else this returns false.
+ *
+ * The memory used by the erased key and value is released back to
+ * the pool (see @ref{pfree(3)}), so any pointers previously obtained
+ * to them must not be used afterwards.
  */
 extern int shash_erase (shash, const char *key);
 
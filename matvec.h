@@ -61,6 +61,10 @@
  * @code{new_vec} allocates a new 4-vector of floats in
  * @code{pool}.
  *
+ * Matrices are aligned to 64 bytes (so each one fits in a single
+ * cache line) and vectors are aligned to 16 bytes, so both can be
+ * loaded directly with aligned SIMD instructions.
+ *
  * You may use these functions to allocate matrices and
  * vectors dynamically, or you may allocate them statically.
  * The other matrix and vector functions available do not
@@ -73,8 +77,8 @@
  *
  * See also: @ref{new_identity_matrix(3)}, @ref{new_zero_vec(3)}.
  */
-#define new_matrix(pool) ((float *) pmalloc ((pool), sizeof (float) * 16))
-#define new_vec(pool) ((float *) pmalloc ((pool), sizeof (float) * 4))
+#define new_matrix(pool) ((float *) pmalloc_aligned ((pool), sizeof (float) * 16, sizeof (float) * 16))
+#define new_vec(pool) ((float *) pmalloc_aligned ((pool), sizeof (float) * 4, sizeof (float) * 4))
 
 /* Variable: identity_matrix - identity matrix and zero vector
  * Variable: zero_vec
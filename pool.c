@@ -26,12 +26,21 @@
 
 /* If set, then calls to pmalloc will initialise the memory to 0xefefef...,
  * helping to catch uninitialised memory problems. This is very useful for
- * debugging new code, but should be turned off on production systems.
+ * debugging new code, but should be turned off on production systems,
+ * either by building with -DDEBUG_UNINITIALISED_MEMORY=0, or at runtime
+ * by setting POOL_POISON=0 in the environment or calling pool_set_poison.
  */
+#ifndef DEBUG_UNINITIALISED_MEMORY
 #define DEBUG_UNINITIALISED_MEMORY 1
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <signal.h>
+#include <pthread.h>
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -45,6 +54,18 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
 #include <pool.h>
 
 struct _pool_allocs
@@ -62,8 +83,11 @@ struct _pool_allocs
 #define _PA_SLOTS(pa) (((pa)->flags & 0x7fff0000U) >> 16)
 #define _PA_SLOTS_USED(pa) ((pa)->flags & 0xffffU)
 
+  /* Not packed: large blocks keep a pointer to their slot, so the
+   * slots must be properly aligned.
+   */
   void *slot[0];
-} __attribute__((packed));
+};
 
 struct _pool_cleanup_slot
 {
@@ -89,45 +113,479 @@ struct _pool_cleanups
   struct _pool_cleanup_slot slot[0];
 } __attribute__((packed));
 
+/* Small allocations are carved out of large chunks using a bump
+ * pointer, so that the common case of pmalloc is a few arithmetic
+ * operations rather than a call to malloc, and delete_pool frees whole
+ * chunks at a time. Each allocation is preceded by a header which
+ * records its size, so that prealloc knows how much to copy when it
+ * has to move a block. Allocations larger than LARGE_ALLOC are still
+ * malloc'd separately and recorded in the _pool_allocs slots, and
+ * their header points back to the slot so that prealloc can update it
+ * in constant time.
+ */
+struct _pool_header
+{
+  size_t size;			/* Usable size of the block, | _PH_ALIGNED. */
+  void **slot;			/* Slot owning a large block, else null. */
+};
+
+/* Blocks from pmalloc_aligned have the _PH_ALIGNED bit set in their
+ * size, and their alignment is stored in the word before the header,
+ * so that prealloc can keep them aligned. Separately malloc'd blocks
+ * have their header somewhere after the start of the malloc'd area,
+ * which is the pointer stored in their slot. The first word of that
+ * area holds the total size malloc'd, | _PH_ALIGNED, so that the size
+ * of any large block can be found from its slot.
+ *
+ * Memory registered with pool_register_malloc is stored in its slot
+ * with the _SLOT_MALLOC bit set, to tell it apart from large blocks.
+ */
+#define _PH_ALIGNED      ((size_t) 1)
+#define _PH_SIZE(h)      ((h)->size & ~_PH_ALIGNED)
+#define _PH_ALIGN(h)     (((size_t *) (h))[-1])
+#define _SLOT_MALLOC     1UL
+#define _SLOT_PTR(s)     ((void *) ((unsigned long) (s) & ~_SLOT_MALLOC))
+
+struct _pool_chunk
+{
+  struct _pool_chunk *next;
+  char *ptr;			/* Next free byte in this chunk. */
+  char *end;			/* End of this chunk. */
+  int mapped;			/* If set, chunk was mmap'd, not malloc'd. */
+};
+
+/* All blocks handed out by the pool are aligned to POOL_ALIGN, which
+ * must be at least the size of the header.
+ */
+#define POOL_ALIGN       (2 * sizeof (void *))
+#define _POOL_ROUND(n)   (((n) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+#define _ALIGN_UP(ptr, align) \
+  ((char *) (((unsigned long) (ptr) + (align) - 1) & ~((align) - 1)))
+#define _CHUNK_HDR_SIZE  _POOL_ROUND (sizeof (struct _pool_chunk))
+
+#define INITIAL_CHUNK_SIZE 1024U
+#define MAX_CHUNK_SIZE     65536U
+
+/* In a pool with POOL_MMAP, POOL_HUGEPAGES or POOL_HUGETLB set, chunks
+ * keep doubling up to MAX_MAPPED_CHUNK_SIZE, and chunks of at least
+ * MMAP_THRESHOLD bytes are mmap'd, so that delete_pool gives them
+ * straight back to the operating system. With huge pages, mmap'd
+ * chunks are a multiple of HUGE_PAGE_SIZE and aligned to it.
+ */
+#define POOL_MAPPED        (POOL_MMAP|POOL_HUGEPAGES|POOL_HUGETLB)
+#define MMAP_THRESHOLD     MAX_CHUNK_SIZE
+#define MAX_MAPPED_CHUNK_SIZE (2U * 1024 * 1024)
+#define HUGE_PAGE_SIZE     ((size_t) 2 * 1024 * 1024)
+
+/* A pool with a NUMA placement behaves like a POOL_MMAP pool, and its
+ * mmap'd chunks and large blocks are given a memory policy with the
+ * mbind system call. We call it directly, using the values of the
+ * kernel ABI, so that libnuma is not needed.
+ */
+#if defined (HAVE_SYS_SYSCALL_H) && defined (SYS_mbind) && \
+    defined (HAVE_SYS_MMAN_H) && defined (MAP_ANONYMOUS)
+#define HAVE_MBIND 1
+#endif
+#define _MPOL_PREFERRED    1
+#define _MPOL_LOCAL        4
+#define _MPOL_MF_MOVE      (1 << 1)
+#define NUMA_MAX_NODES     1024
+#define LARGE_ALLOC        4096U	/* Must be < MAX_CHUNK_SIZE / 2 */
+
+/* Small blocks are rounded up to one of NR_SIZE_CLASSES sizes: multiples
+ * of 16 bytes up to 64, then four evenly spaced sizes per power of two
+ * up to LARGE_ALLOC. Blocks released by pfree are kept on a free list
+ * for their size class and handed out again by the next allocation of
+ * that class. The list is threaded through the first word of each free
+ * block. The array of list heads is itself allocated from the pool the
+ * first time a block is freed.
+ */
+#define NR_SIZE_CLASSES  28	/* For LARGE_ALLOC == 4096 */
+
+/* In a concurrent pool, each thread carves a magazine of up to
+ * MAGAZINE_SIZE bytes out of the current chunk while holding the pool
+ * lock, and then bump-allocates small blocks from it without locking.
+ * A thread caches magazines for up to NR_MAGAZINES pools at a time.
+ */
+#define MAGAZINE_SIZE    16384U
+#define NR_MAGAZINES     4
+
+/* When a subpool is deleted, its header and one chunk are kept on a
+ * list in the parent (up to this many per parent) and reused by the
+ * next call to new_subpool.
+ */
+#define MAX_RECYCLED_SUBPOOLS 8
+
 #define INITIAL_PA_SLOTS 16U
 #define MAX_PA_SLOTS     16384U	/* Must be <= 16384 */
 #define INITIAL_PC_SLOTS 2U
 #define MAX_PC_SLOTS     16384U	/* Must be <= 16384 */
+#define INITIAL_FDS      16
 
 struct pool
 {
   /* If this is a subpool, then this points to the parent. */
   struct pool *parent_pool;
 
-  /* When subpools are stored on a list, this is used to link the list. */
-  struct pool *next;
+  /* When subpools are stored on a list, this is used to link the list.
+   * The subpool list is doubly linked so that a subpool can remove
+   * itself in constant time.
+   */
+  struct pool *next, *prev;
 
   /* Sub-pools. */
   struct pool *subpool_list;
 
+  /* Deleted subpools kept for reuse, linked through next. */
+  struct pool *recycled_list;
+  int nr_recycled;
+
+  /* Chunks of memory for small allocations. The head chunk is the
+   * one currently being allocated from.
+   */
+  struct _pool_chunk *chunks;
+
+  /* Free lists of small blocks, indexed by size class, or null if
+   * nothing has been freed yet.
+   */
+  void **free_lists;
+
   /* Pointer to head block of memory allocations. */
   struct _pool_allocs *allocs;
 
   /* Pointer to head block of clean-up functions. */
   struct _pool_cleanups *cleanups;
+
+  /* File descriptors to close, in a malloc'd array which is kept
+   * until the pool is freed.
+   */
+  int *fds;
+  int nr_fds, max_fds;
+
+  /* Subpools are numbered in the order they are created, so that
+   * pool_release_to_mark can tell which were created after the mark.
+   */
+  unsigned long serial, next_serial;
+
+  /* Bump pointer recorded by the innermost pool_mark, or null. A block
+   * which ends there was allocated before the mark, and must not be
+   * grown in place over memory which releasing to the mark reuses.
+   */
+  char *mark_ptr;
+
+  /* POOL_* flags, inherited by subpools. */
+  int flags;
+
+  /* In a concurrent pool, this lock protects all of the above. The
+   * generation number distinguishes this pool from any earlier pool
+   * which had the same address, so that stale magazines are ignored.
+   */
+  pthread_mutex_t lock;
+  unsigned long generation;
+
+  /* Statistics returned by pool_get_stats. The first group covers this
+   * pool and all its subpools. Every ancestor is updated when a chunk,
+   * large block or pool structure is allocated or freed, which is rare
+   * enough that atomic updates are cheap. Deleted subpools which are
+   * kept for reuse still count towards the reserved bytes and the
+   * structure size of their parent.
+   */
+  size_t bytes_reserved, peak_bytes_reserved, struct_size;
+  int nr_subpools;
+
+  /* The second group covers this pool only. own_reserved is the part
+   * of bytes_reserved which is chunks and large blocks of this pool.
+   * The rest count blocks allocated directly from this pool since it
+   * was created or last reset.
+   */
+  size_t own_reserved;
+  size_t bytes_requested, bytes_in_use;
+  unsigned long nr_allocations;
+  int nr_cleanups;
+
+  /* Limit on bytes_reserved, or 0 for no limit, and the function to
+   * call when an allocation would exceed the limit of this pool or of
+   * one of its ancestors.
+   */
+  size_t limit;
+  void (*over_limit_handler) (pool);
+
+  /* NUMA node for memory, or POOL_NUMA_DEFAULT or
+   * POOL_NUMA_FIRST_TOUCH. Inherited by subpools.
+   */
+  int numa_node;
+
+  /* Where the pool was created, and the allocation profile for the
+   * pool if any allocations in it have been sampled. Pools with a
+   * profile are linked on profile_pools. These fields are protected
+   * by profile_lock.
+   */
+  void *creator;
+  struct _pool_profile *profile;
+  struct pool *profile_next, *profile_prev;
+};
+
+struct _pool_magazine
+{
+  pool pool;
+  unsigned long generation;
+  char *ptr;			/* Next free byte in the magazine. */
+  char *end;			/* End of the magazine. */
 };
 
+static __thread struct _pool_magazine magazines[NR_MAGAZINES];
+static unsigned long next_generation = 0;
+
 #ifndef NO_GLOBAL_POOL
 pool global_pool;
 #endif
 
+/* Tracing. If POOL_TRACE is set to a filename, every pool operation is
+ * logged to that file. By default each operation is written as a line
+ * of text straight away. If POOL_TRACE_FORMAT=binary, operations are
+ * instead stored as fixed-size records in a buffer for each thread,
+ * which is written out when it fills up, when the thread exits and
+ * when the program exits. This is cheap enough to leave running under
+ * real load. trace/curallocs.pl reads either format.
+ *
+ * The binary file starts with a struct _pool_trace_file_header,
+ * followed by struct _pool_trace_records in native byte order. Records
+ * from different threads are not in time order.
+ */
+struct _pool_trace_file_header
+{
+  char magic[8];		/* "POOLTRC1" */
+  uint32_t record_size;		/* sizeof (struct _pool_trace_record) */
+  uint32_t reserved;
+};
+
+struct _pool_trace_record
+{
+  uint64_t time;		/* Nanoseconds since tracing started. */
+  uint64_t caller;
+  uint64_t ptr1, ptr2, ptr3;
+  int64_t i1;
+  uint32_t fn;			/* Index into trace_fn_names. */
+  uint32_t thread;		/* Thread number, starting at 1. */
+};
+
+#define TRACE_BUFFER_RECORDS 128
+
+struct _pool_trace_buffer
+{
+  int thread;
+  int used;
+  struct _pool_trace_record record[TRACE_BUFFER_RECORDS];
+};
+
+/* The order of this list is part of the binary trace format. */
+static const char *trace_fn_names[] = {
+  "new_pool", "new_subpool", "delete_pool", "pool_reset", "pmalloc",
+  "pcalloc", "pmalloc_aligned", "prealloc", "pfree", "pool_mark",
+  "pool_release_to_mark", 0
+};
+
 static int trace_fd = -1;
 static const char *trace_filename = 0;
+static int trace_binary = 0;
+/* Set once the main thread's buffer has been flushed at exit. Records
+ * made after that, by destructors or atexit handlers which run later,
+ * are written straight away.
+ */
+static int trace_closed = 0;
+static struct timespec trace_start;
+static int nr_trace_threads = 0;
+static pthread_key_t trace_key;
+static __thread struct _pool_trace_buffer trace_buffer;
+
+/* Profiling. If POOL_PROFILE is set to a filename prefix, allocations
+ * are sampled, on average once every POOL_PROFILE_RATE bytes (default
+ * 512 KB), and each pool counts the sampled allocations made from it
+ * by each call site. Each sample is recorded with a stack made of the
+ * caller followed by the places where the pool and its ancestors were
+ * created, so that the same call site is split by the kind of pool it
+ * allocates in. When a subpool is deleted its profile is added to its
+ * parent's, and when a pool with no parent is deleted its profile is
+ * written out. Sending the process POOL_PROFILE_SIGNAL (default
+ * SIGUSR2) writes out the profiles of all live pools, the next time a
+ * sample is taken or a pool is deleted.
+ *
+ * Profiles are written as <prefix>.<pid>.<seq>.heap, in the legacy
+ * heap profile format read by pprof.
+ */
+#define PROFILE_DEPTH         8
+#define PROFILE_DEFAULT_RATE  (512 * 1024)
+
+struct _pool_profile_entry
+{
+  void *stack[PROFILE_DEPTH];
+  int depth;
+  unsigned long count;		/* Number of sampled allocations. */
+  unsigned long bytes;		/* Bytes requested by them. */
+};
+
+struct _pool_profile
+{
+  int nr_entries, max_entries;
+  struct _pool_profile_entry entry[0];
+};
+
+static const char *profile_prefix = 0;
+static long profile_rate = 0;
+static int profile_seq = 0;
+static volatile sig_atomic_t profile_dump_requested = 0;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool profile_pools = 0;
+static __thread long profile_countdown = 0;
+static __thread unsigned profile_seed = 0;
+
+static void init_profile (void) __attribute__((constructor));
+static void _pool_profile_sample (pool p, size_t n, void *caller);
+static void _pool_profile_delete (pool p);
+static void _pool_profile_dump_all (void);
+
+/* Count down the bytes until the next sample in this thread. */
+#define PROFILE(p, n) do { if (profile_rate && (profile_countdown -= (long) (n)) < 0) _pool_profile_sample ((p), (n), __builtin_return_address (0)); } while (0)
 
 static void (*bad_malloc_handler) (void) = abort;
+#if DEBUG_UNINITIALISED_MEMORY
+static int poison = 1;
+static void init_poison (void) __attribute__((constructor));
+#endif
+static void **_pool_register (pool p, void *ptr);
 #ifndef NO_GLOBAL_POOL
 static void alloc_global_pool (void) __attribute__((constructor));
 static void free_global_pool (void) __attribute__((destructor));
 #endif
 static void open_trace_file (void) __attribute__((constructor));
-static void trace (const char *fn, void *caller, struct pool *ptr1, void *ptr2, void *ptr3, int i1);
+static void close_trace_file (void) __attribute__((destructor));
+static void trace (int *fn_index, const char *fn, void *caller, struct pool *ptr1, void *ptr2, void *ptr3, long i1);
+static void trace_flush (void *bv);
+
+/* Each call site remembers the index of its function name, so that it
+ * only has to be looked up once.
+ */
+#define TRACE(ptr1, ptr2, ptr3, i1) do { if (trace_filename) { static int fn_index = -1; trace (&fn_index, __PRETTY_FUNCTION__, __builtin_return_address (0), (ptr1), (ptr2), (ptr3), (i1)); } } while (0)
+
+static inline void
+_pool_lock (pool p)
+{
+  if (p->flags & POOL_CONCURRENT)
+    pthread_mutex_lock (&p->lock);
+}
+
+static inline void
+_pool_unlock (pool p)
+{
+  if (p->flags & POOL_CONCURRENT)
+    pthread_mutex_unlock (&p->lock);
+}
+
+/* Point the allocs and cleanups lists at the empty blocks which are
+ * allocated along with the pool header, and give the pool a new
+ * generation number.
+ */
+static void
+_pool_init_lists (pool p)
+{
+  p->allocs = (struct _pool_allocs *) ((void *)p + sizeof (struct pool));
+  p->cleanups = (struct _pool_cleanups *)
+    ((void *)p + sizeof (struct pool) + sizeof (struct _pool_allocs)
+     + INITIAL_PA_SLOTS * sizeof (void *));
+
+  p->allocs->next = 0;
+  p->allocs->flags = 0x80000000U | INITIAL_PA_SLOTS << 16;
+  p->cleanups->next = 0;
+  p->cleanups->flags = 0x80000000U | INITIAL_PC_SLOTS << 16;
+  p->free_lists = 0;
+  p->generation = __sync_add_and_fetch (&next_generation, 1);
+  p->mark_ptr = 0;
+
+  p->bytes_requested = p->bytes_in_use = 0;
+  p->nr_allocations = 0;
+  p->nr_cleanups = 0;
+}
+
+/* Add to the statistics of p and all its ancestors. */
+static void
+_pool_account (pool p, long reserved, long struct_size, int nr_subpools)
+{
+  size_t r, peak;
+
+  for (; p; p = p->parent_pool)
+    {
+      r = __sync_add_and_fetch (&p->bytes_reserved, reserved);
+      while ((peak = __atomic_load_n (&p->peak_bytes_reserved,
+				      __ATOMIC_RELAXED)) < r &&
+	     !__sync_bool_compare_and_swap (&p->peak_bytes_reserved, peak, r))
+	;
+      if (struct_size)
+	__sync_fetch_and_add (&p->struct_size, struct_size);
+      if (nr_subpools)
+	__sync_fetch_and_add (&p->nr_subpools, nr_subpools);
+    }
+}
+
+/* Return true if reserving another n bytes would take p or one of its
+ * ancestors over its limit. In a concurrent pool the limit may be
+ * overshot slightly, because other threads can be reserving memory in
+ * the same subtree at the same time.
+ */
+static inline int
+_pool_over_limit (pool p, size_t n)
+{
+  for (; p; p = p->parent_pool)
+    if (p->limit && p->bytes_reserved + n > p->limit)
+      return 1;
+  return 0;
+}
+
+/* Called without the pool locked when an allocation has failed
+ * because of a limit. Returns true if the allocation should be tried
+ * once more, because the handler may have released some memory.
+ */
+static int
+_pool_call_over_limit_handler (pool p)
+{
+  if (p->over_limit_handler == 0)
+    return 0;
+  p->over_limit_handler (p);
+  return 1;
+}
+
+/* Record memory obtained from or returned to malloc for chunks and
+ * large blocks of p. The pool must be locked.
+ */
+static inline void
+_pool_reserve (pool p, long bytes)
+{
+  p->own_reserved += bytes;
+  _pool_account (p, bytes, 0, 0);
+}
 
-#define TRACE(ptr1, ptr2, ptr3, i1) do { if (trace_filename) trace (__PRETTY_FUNCTION__, __builtin_return_address (0), (ptr1), (ptr2), (ptr3), (i1)); } while (0)
+/* Count nr allocations of requested bytes, and a change of in_use
+ * bytes in live blocks. Concurrent pools allocate without the lock, so
+ * they need atomic updates.
+ */
+static inline void
+_pool_count (pool p, long in_use, size_t requested, int nr)
+{
+  if (p->flags & POOL_CONCURRENT)
+    {
+      __sync_fetch_and_add (&p->bytes_in_use, in_use);
+      if (nr)
+	{
+	  __sync_fetch_and_add (&p->bytes_requested, requested);
+	  __sync_fetch_and_add (&p->nr_allocations, nr);
+	}
+    }
+  else
+    {
+      p->bytes_in_use += in_use;
+      p->bytes_requested += requested;
+      p->nr_allocations += nr;
+    }
+}
 
 pool
 new_pool ()
@@ -144,14 +602,11 @@ new_pool ()
   if (p == 0) bad_malloc_handler ();
 
   memset (p, 0, size);
-
-  p->allocs = (struct _pool_allocs *) ((void *)p + sizeof (struct pool));
-  p->cleanups = (struct _pool_cleanups *)
-    ((void *)p + sizeof (struct pool) + sizeof (struct _pool_allocs)
-     + INITIAL_PA_SLOTS * sizeof (void *));
-
-  p->allocs->flags = 0x80000000U | INITIAL_PA_SLOTS << 16;
-  p->cleanups->flags = 0x80000000U | INITIAL_PC_SLOTS << 16;
+  _pool_init_lists (p);
+  p->struct_size = size;
+  p->nr_subpools = 1;
+  p->numa_node = POOL_NUMA_DEFAULT;
+  p->creator = __builtin_return_address (0);
 
   TRACE (p, 0, 0, 0);
 
@@ -161,21 +616,110 @@ new_pool ()
 pool
 new_subpool (pool parent)
 {
-  pool p = new_pool ();
-  p->parent_pool = parent;
+  pool p;
 
+  _pool_lock (parent);
+  p = parent->recycled_list;
+  if (p)
+    {
+      parent->recycled_list = p->next;
+      parent->nr_recycled--;
+    }
+  _pool_unlock (parent);
+
+  if (p == 0)
+    {
+      p = new_pool ();
+      _pool_account (parent, p->bytes_reserved, p->struct_size, 1);
+    }
+  else
+    _pool_account (parent, 0, 0, 1);
+  p->parent_pool = parent;
+  p->limit = 0;
+  p->over_limit_handler = parent->over_limit_handler;
+  p->numa_node = parent->numa_node;
+  p->creator = __builtin_return_address (0);
+  if (parent->flags != p->flags)
+    pool_set_flags (p, parent->flags);
+
+  _pool_lock (parent);
+  p->serial = parent->next_serial++;
+  p->prev = 0;
   p->next = parent->subpool_list;
+  if (p->next)
+    p->next->prev = p;
   parent->subpool_list = p;
+  _pool_unlock (parent);
 
   TRACE (p, parent, 0, 0);
 
   return p;
 }
 
+/* Return the number of bytes malloc'd for a large block, given the
+ * pointer stored in its slot.
+ */
+static inline size_t
+_large_size (void *base)
+{
+  size_t w = *(size_t *) base;
+
+  if (w & _PH_ALIGNED)
+    return w & ~_PH_ALIGNED;
+  else
+    return sizeof (struct _pool_header) + w;
+}
+
+static inline void
+_pool_free_chunk (struct _pool_chunk *c)
+{
+#if defined (HAVE_SYS_MMAN_H) && defined (MAP_ANONYMOUS)
+  if (c->mapped)
+    munmap (c, c->end - (char *) c);
+  else
+#endif
+    free (c);
+}
+
+static int
+_int_compare (const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+/* Close the file descriptors registered on the pool, starting with
+ * the one at index from. They are sorted first, so that runs of
+ * consecutive descriptors can be closed with one system call.
+ */
+static void
+_pool_close_fds (pool p, int from)
+{
+  int i, j, k;
+
+  if (p->nr_fds - from > 1)
+    qsort (p->fds + from, p->nr_fds - from, sizeof (int), _int_compare);
+
+  for (i = from; i < p->nr_fds; i = j)
+    {
+      for (j = i + 1; j < p->nr_fds && p->fds[j] == p->fds[j-1] + 1; ++j)
+	;
+#if defined (HAVE_SYS_SYSCALL_H) && defined (SYS_close_range)
+      if (j - i > 1 &&
+	  syscall (SYS_close_range, p->fds[i], p->fds[j-1], 0) == 0)
+	continue;
+#endif
+      for (k = i; k < j; ++k)
+	close (p->fds[k]);
+    }
+
+  p->nr_fds = from;
+}
+
 static inline void
 _do_cleanups (pool p)
 {
   struct _pool_cleanups *pc, *pc_next;
+  long struct_size = 0;
   int i;
 
   for (pc = p->cleanups; pc; pc = pc_next)
@@ -185,14 +729,28 @@ _do_cleanups (pool p)
       for (i = 0; i < _PC_SLOTS_USED (pc); ++i)
 	pc->slot[i].fn (pc->slot[i].data);
       if (!_PC_NO_FREE (pc))
-	free (pc);
+	{
+	  struct_size += sizeof (struct _pool_cleanups)
+	    + _PC_SLOTS (pc) * sizeof (struct _pool_cleanup_slot);
+	  free (pc);
+	}
     }
+
+  if (struct_size)
+    _pool_account (p, 0, -struct_size, 0);
+
+  _pool_close_fds (p, 0);
 }
 
+/* Free all allocations. If keep_chunk is set, the current chunk is
+ * emptied and kept for reuse instead of being freed.
+ */
 static inline void
-_do_frees (pool p)
+_do_frees (pool p, int keep_chunk)
 {
   struct _pool_allocs *pa, *pa_next;
+  struct _pool_chunk *c, *c_next;
+  long struct_size = 0, kept = 0;
   int i;
 
   for (pa = p->allocs; pa; pa = pa_next)
@@ -200,128 +758,856 @@ _do_frees (pool p)
       pa_next = pa->next;
 
       for (i = 0; i < _PA_SLOTS_USED (pa); ++i)
-	free (pa->slot[i]);
+	if (pa->slot[i])
+	  free (_SLOT_PTR (pa->slot[i]));
       if (!_PA_NO_FREE (pa))
-	free (pa);
-    }
-}
-
-void
-delete_pool (pool p)
-{
-  _do_cleanups (p);
-
-  /* Clean up any sub-pools. */
-  while (p->subpool_list) delete_pool (p->subpool_list);
-
-  _do_frees (p);
-
-  /* Do I have a parent? If so, remove myself from my parent's subpool
-   * list.
-   */
-  if (p->parent_pool)
-    {
-      pool parent = p->parent_pool, this, last = 0;
-
-      for (this = parent->subpool_list; this; last = this, this = this->next)
 	{
-	  if (this == p)
-	    {
-	      /* Remove this one. */
-	      if (last != 0)
-		last->next = this->next;
-	      else
-		parent->subpool_list = this->next;
-
-	      goto found_me;
-	    }
+	  struct_size += sizeof (struct _pool_allocs)
+	    + _PA_SLOTS (pa) * sizeof (void *);
+	  free (pa);
 	}
+    }
 
-      abort ();			/* Oops - self not found on subpool list. */
-    found_me:;
+  c = p->chunks;
+  if (keep_chunk && c)
+    {
+      c_next = c->next;
+      c->next = 0;
+      c->ptr = (char *) c + _CHUNK_HDR_SIZE;
+      kept = c->end - (char *) c;
+      c = c_next;
     }
+  else
+    p->chunks = 0;
 
-  free (p);
+  for (; c; c = c_next)
+    {
+      c_next = c->next;
+      _pool_free_chunk (c);
+    }
 
-  TRACE (p, 0, 0, 0);
+  /* Everything else this pool reserved was a chunk or a large block,
+   * and has now been freed.
+   */
+  _pool_account (p, kept - (long) p->own_reserved, -struct_size, 0);
+  p->own_reserved = kept;
 }
 
-void *
-pmalloc (pool p, size_t n)
+/* Run cleanups, delete subpools and free all allocations, leaving the
+ * pool header and its current chunk ready for reuse.
+ */
+static void
+_pool_clear (pool p)
 {
-  void *ptr;
-
-  ptr = malloc (n);
-  if (ptr == 0) bad_malloc_handler ();
+  _do_cleanups (p);
 
-#if DEBUG_UNINITIALISED_MEMORY
-  memset (ptr, 0xef, n);
-#endif
+  /* Clean up any sub-pools. */
+  while (p->subpool_list) delete_pool (p->subpool_list);
 
-  pool_register_malloc (p, ptr);
+  _do_frees (p, 1);
+  _pool_init_lists (p);
+}
 
-  TRACE (p, ptr, 0, n);
+void
+pool_reset (pool p)
+{
+  _pool_clear (p);
 
-  return ptr;
+  TRACE (p, 0, 0, 0);
 }
 
-void *
-pcalloc (pool p, size_t nmemb, size_t size)
+void
+pool_mark (pool p, struct pool_mark *mark)
 {
-  void *ptr = pmalloc (p, nmemb * size);
-  if (ptr) memset (ptr, 0, nmemb * size);
-  return ptr;
+  _pool_lock (p);
+  mark->chunk = p->chunks;
+  mark->ptr = p->chunks ? p->chunks->ptr : 0;
+  mark->allocs = p->allocs;
+  mark->nr_allocs = _PA_SLOTS_USED (p->allocs);
+  mark->cleanups = p->cleanups;
+  mark->nr_cleanup_fns = _PC_SLOTS_USED (p->cleanups);
+  mark->nr_fds = p->nr_fds;
+  mark->subpool_serial = p->next_serial;
+  mark->bytes_in_use = p->bytes_in_use;
+  mark->prev_mark_ptr = p->mark_ptr;
+  p->mark_ptr = mark->ptr;
+  _pool_unlock (p);
+
+  TRACE (p, (void *) mark, 0, 0);
 }
 
-void *
-prealloc (pool p, void *ptr, size_t n)
+void
+pool_release_to_mark (pool p, const struct pool_mark *mark)
 {
-  struct _pool_allocs *pa;
-  int i;
-  void *new_ptr;
-
-  if (ptr == 0)
-    return pmalloc (p, n);
-
-  new_ptr = realloc (ptr, n);
-  if (new_ptr == 0) bad_malloc_handler ();
+  struct _pool_cleanups *pc, *pc_next;
+  struct _pool_allocs *pa, *pa_next;
+  struct _pool_chunk *c, *c_next;
+  long struct_size = 0, reserved = 0;
+  int i, used, nr_cleanups = 0;
+  void *ptr;
 
-  /* XXX This is inefficient. We need to search through the
-   * allocations to find this one and update the pointer.
+  /* Run the cleanups registered since the mark, in the same order as
+   * _do_cleanups would.
    */
-  if (ptr != new_ptr)
+  for (pc = p->cleanups; pc != mark->cleanups; pc = pc_next)
     {
-      for (pa = p->allocs; pa; pa = pa->next)
-	{
-	  for (i = 0; i < _PA_SLOTS_USED (pa); ++i)
-	    if (pa->slot[i] == ptr)
-	      {
-		pa->slot[i] = new_ptr;
-		goto found;
-	      }
-	}
-      abort ();
+      pc_next = pc->next;
+      for (i = 0; i < _PC_SLOTS_USED (pc); ++i)
+	pc->slot[i].fn (pc->slot[i].data);
+      nr_cleanups += _PC_SLOTS_USED (pc);
+      struct_size += sizeof (struct _pool_cleanups)
+	+ _PC_SLOTS (pc) * sizeof (struct _pool_cleanup_slot);
+      free (pc);
+    }
+  p->cleanups = pc;
+  used = _PC_SLOTS_USED (pc);
+  for (i = mark->nr_cleanup_fns; i < used; ++i)
+    pc->slot[i].fn (pc->slot[i].data);
+  if (used > mark->nr_cleanup_fns)
+    {
+      nr_cleanups += used - mark->nr_cleanup_fns;
+      pc->flags -= used - mark->nr_cleanup_fns;
+    }
 
-    found:;
+  if (p->nr_fds > mark->nr_fds)
+    {
+      nr_cleanups += p->nr_fds - mark->nr_fds;
+      _pool_close_fds (p, mark->nr_fds);
     }
+  p->nr_cleanups -= nr_cleanups;
 
-  TRACE (p, ptr, new_ptr, n);
+  /* Delete the subpools created since the mark. Newer subpools are
+   * always nearer the front of the list.
+   */
+  while (p->subpool_list && p->subpool_list->serial >= mark->subpool_serial)
+    delete_pool (p->subpool_list);
+
+  /* Free the large blocks and malloc'd memory registered since the
+   * mark.
+   */
+  for (pa = p->allocs; ; pa = pa_next)
+    {
+      pa_next = pa->next;
+      for (i = pa == mark->allocs ? mark->nr_allocs : 0;
+	   i < _PA_SLOTS_USED (pa); ++i)
+	if ((ptr = pa->slot[i]) != 0)
+	  {
+	    if (!((unsigned long) ptr & _SLOT_MALLOC))
+	      reserved += _large_size (ptr);
+	    free (_SLOT_PTR (ptr));
+	  }
+      if (pa == mark->allocs)
+	break;
+      struct_size += sizeof (struct _pool_allocs)
+	+ _PA_SLOTS (pa) * sizeof (void *);
+      free (pa);
+    }
+  p->allocs = pa;
+  if (_PA_SLOTS_USED (pa) > mark->nr_allocs)
+    pa->flags -= _PA_SLOTS_USED (pa) - mark->nr_allocs;
+
+  /* Free the chunks created since the mark, and move the bump pointer
+   * of the chunk which was current back to where it was.
+   */
+  for (c = p->chunks; c != mark->chunk; c = c_next)
+    {
+      c_next = c->next;
+      reserved += c->end - (char *) c;
+      _pool_free_chunk (c);
+    }
+  p->chunks = c;
+  if (c)
+    c->ptr = mark->ptr;
+
+  /* Freed blocks may be anywhere, including in memory which has just
+   * been released, so forget them all. In a concurrent pool, magazines
+   * of other threads may point past the mark, so start a new
+   * generation.
+   */
+  p->free_lists = 0;
+  if (p->flags & POOL_CONCURRENT)
+    p->generation = __sync_add_and_fetch (&next_generation, 1);
+
+  if (reserved || struct_size)
+    {
+      p->own_reserved -= reserved;
+      _pool_account (p, -reserved, -struct_size, 0);
+    }
+  p->bytes_in_use = mark->bytes_in_use;
+  p->mark_ptr = mark->prev_mark_ptr;
+
+  TRACE (p, (void *) mark, 0, 0);
+}
+
+void
+delete_pool (pool p)
+{
+  pool sp;
+  struct _pool_chunk *c;
+
+  _pool_clear (p);
+
+  if (profile_rate)
+    _pool_profile_delete (p);
+
+  /* A mmap'd chunk is given back to the system now, rather than kept
+   * with the pool for reuse.
+   */
+  c = p->chunks;
+  if (c && c->mapped)
+    {
+      _pool_reserve (p, -(long) (c->end - (char *) c));
+      p->chunks = 0;
+      _pool_free_chunk (c);
+    }
+
+  /* Do I have a parent? If so, remove myself from my parent's subpool
+   * list, and keep this pool for reuse by the parent if there is room.
+   */
+  if (p->parent_pool)
+    {
+      pool parent = p->parent_pool;
+
+      _pool_lock (parent);
+
+      if (p->prev)
+	p->prev->next = p->next;
+      else if (parent->subpool_list == p)
+	parent->subpool_list = p->next;
+      else
+	abort ();		/* Oops - self not found on subpool list. */
+      if (p->next)
+	p->next->prev = p->prev;
+
+      if (parent->nr_recycled < MAX_RECYCLED_SUBPOOLS)
+	{
+	  p->next = parent->recycled_list;
+	  parent->recycled_list = p;
+	  parent->nr_recycled++;
+	  _pool_unlock (parent);
+	  _pool_account (parent, 0, 0, -1);
+
+	  TRACE (p, 0, 0, 0);
+	  return;
+	}
+      _pool_unlock (parent);
+    }
+
+  _do_frees (p, 0);
+
+  while ((sp = p->recycled_list) != 0)
+    {
+      p->recycled_list = sp->next;
+      sp->parent_pool = 0;
+      delete_pool (sp);
+    }
+
+  /* What remains is the pool structure itself and any recycled
+   * subpools freed above.
+   */
+  if (p->fds)
+    {
+      _pool_account (p, 0, -(long) (p->max_fds * sizeof (int)), 0);
+      free (p->fds);
+    }
+
+  if (p->parent_pool)
+    _pool_account (p->parent_pool, -(long) p->bytes_reserved,
+		   -(long) p->struct_size, -p->nr_subpools);
+
+  if (p->flags & POOL_CONCURRENT)
+    pthread_mutex_destroy (&p->lock);
+
+  free (p);
+
+  TRACE (p, 0, 0, 0);
+}
+
+/* Apply the NUMA policy of the pool to the whole pages in the n bytes
+ * at ptr. Normally the memory has not been touched yet, and the policy
+ * decides where it will be placed when it is. Pass move if some of it
+ * may already have been placed, for example by realloc copying it.
+ * Errors (such as a node which does not exist) are ignored, leaving
+ * the memory wherever the kernel would have put it anyway.
+ */
+static void
+_pool_numa_bind (pool p, void *ptr, size_t n, int move)
+{
+#ifdef HAVE_MBIND
+  unsigned long mask[NUMA_MAX_NODES / (8 * sizeof (long))];
+  char *start = _ALIGN_UP (ptr, (unsigned long) getpagesize ());
+  char *end = (char *) (((unsigned long) ptr + n) & ~(getpagesize () - 1UL));
+
+  if (p->numa_node == POOL_NUMA_DEFAULT || end <= start)
+    return;
+
+  if (p->numa_node == POOL_NUMA_FIRST_TOUCH)
+    syscall (SYS_mbind, start, end - start, _MPOL_LOCAL, 0, 0,
+	     move ? _MPOL_MF_MOVE : 0);
+  else
+    {
+      memset (mask, 0, sizeof mask);
+      mask[p->numa_node / (8 * sizeof (long))] |=
+	1UL << (p->numa_node % (8 * sizeof (long)));
+      syscall (SYS_mbind, start, end - start, _MPOL_PREFERRED,
+	       mask, NUMA_MAX_NODES + 1, move ? _MPOL_MF_MOVE : 0);
+    }
+#endif
+}
+
+#if defined (HAVE_SYS_MMAN_H) && defined (MAP_ANONYMOUS)
+/* mmap a chunk of size bytes for a pool with huge pages, aligned to
+ * HUGE_PAGE_SIZE. Explicit huge pages are tried first if requested,
+ * and if none are available we fall back to transparent huge pages.
+ * Returns null if mmap fails.
+ */
+static void *
+_pool_mmap_huge (pool p, size_t size)
+{
+  char *base, *ptr;
+
+#ifdef MAP_HUGETLB
+  if (p->flags & POOL_HUGETLB)
+    {
+      ptr = mmap (0, size, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+      if (ptr != MAP_FAILED)
+	return ptr;
+    }
+#endif
+
+  /* Over-allocate and trim, to get an aligned region. */
+  base = mmap (0, size + HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE,
+	       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return 0;
+
+  ptr = _ALIGN_UP (base, HUGE_PAGE_SIZE);
+  if (ptr > base)
+    munmap (base, ptr - base);
+  munmap (ptr + size, base + HUGE_PAGE_SIZE - ptr);
+
+#ifdef MADV_HUGEPAGE
+  madvise (ptr, size, MADV_HUGEPAGE);
+#endif
+
+  return ptr;
+}
+#endif
+
+/* Allocate a new chunk big enough for at least n more bytes and
+ * make it the current chunk. Chunks double in size up to
+ * MAX_CHUNK_SIZE, so a pool which makes many small allocations only
+ * calls malloc a logarithmic number of times. Returns null if the
+ * chunk would take the pool over a limit.
+ */
+static struct _pool_chunk *
+_pool_new_chunk (pool p, size_t n)
+{
+  struct _pool_chunk *c = 0;
+  size_t size = INITIAL_CHUNK_SIZE;
+  int mapped_pool = (p->flags & POOL_MAPPED) ||
+    p->numa_node != POOL_NUMA_DEFAULT;
+  size_t max = mapped_pool ? MAX_MAPPED_CHUNK_SIZE : MAX_CHUNK_SIZE;
+  int mapped = 0;
+
+  if (p->chunks)
+    {
+      size = p->chunks->end - (char *) p->chunks;
+      if (size < max)
+	size *= 2;
+    }
+  while (size < _CHUNK_HDR_SIZE + n)
+    size *= 2;
+
+#if defined (HAVE_SYS_MMAN_H) && defined (MAP_ANONYMOUS)
+  if (mapped_pool && size >= MMAP_THRESHOLD)
+    {
+      mapped = 1;
+      if (p->flags & (POOL_HUGEPAGES|POOL_HUGETLB))
+	size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    }
+#endif
+
+  if (_pool_over_limit (p, size))
+    return 0;
+
+#if defined (HAVE_SYS_MMAN_H) && defined (MAP_ANONYMOUS)
+  if (mapped)
+    {
+      if (p->flags & (POOL_HUGEPAGES|POOL_HUGETLB))
+	c = _pool_mmap_huge (p, size);
+      else
+	{
+	  c = mmap (0, size, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	  if (c == MAP_FAILED)
+	    c = 0;
+	}
+      if (c == 0) bad_malloc_handler ();
+      _pool_numa_bind (p, c, size, 0);
+    }
+  else
+#endif
+    {
+      c = malloc (size);
+      if (c == 0) bad_malloc_handler ();
+    }
+
+  c->next = p->chunks;
+  c->ptr = (char *) c + _CHUNK_HDR_SIZE;
+  c->end = (char *) c + size;
+  c->mapped = mapped;
+  p->chunks = c;
+  _pool_reserve (p, size);
+
+  return c;
+}
+
+/* Return the size class for an n byte block, and the size of blocks
+ * in that class.
+ */
+static inline int
+_size_class (size_t n, size_t *class_size)
+{
+  int b, sub;
+
+  if (n <= 64)
+    {
+      sub = n ? (n - 1) / 16 : 0;
+      *class_size = (sub + 1) * 16;
+      return sub;
+    }
+
+  b = sizeof (long) * 8 - 1 - __builtin_clzl (n - 1);
+  sub = (n - 1 - (1UL << b)) >> (b - 2);
+  *class_size = (1UL << b) + ((unsigned long) (sub + 1) << (b - 2));
+  return 4 + (b - 6) * 4 + sub;
+}
+
+/* Allocate a block of at least n bytes, without initialising it.
+ * Returns null if the pool is over its limit.
+ */
+static void *
+_pool_alloc (pool p, size_t n)
+{
+  struct _pool_chunk *c = p->chunks;
+  struct _pool_header *h;
+  size_t size;
+  int sc;
+  void *ptr;
+
+  if (n > LARGE_ALLOC)
+    {
+      if (_pool_over_limit (p, sizeof *h + _POOL_ROUND (n)))
+	return 0;
+
+      h = malloc (sizeof *h + _POOL_ROUND (n));
+      if (h == 0) bad_malloc_handler ();
+
+      h->size = _POOL_ROUND (n);
+      h->slot = _pool_register (p, h);
+      _pool_reserve (p, sizeof *h + h->size);
+      _pool_numa_bind (p, h + 1, h->size, 0);
+
+      return h + 1;
+    }
+
+  sc = _size_class (n, &size);
+  if (p->free_lists && p->free_lists[sc])
+    {
+      ptr = p->free_lists[sc];
+      p->free_lists[sc] = *(void **) ptr;
+      return ptr;
+    }
+
+  if ((c == 0 || c->end - c->ptr < sizeof *h + size) &&
+      (c = _pool_new_chunk (p, sizeof *h + size)) == 0)
+    return 0;
+
+  h = (struct _pool_header *) c->ptr;
+  c->ptr += sizeof *h + size;
+  h->size = size;
+  h->slot = 0;
+
+  return h + 1;
+}
+
+/* Allocate a block of at least n bytes aligned to align, which is a
+ * power of two greater than POOL_ALIGN. The padding needed to align
+ * the block is wasted, apart from the word which records the alignment.
+ */
+static void *
+_pool_alloc_aligned (pool p, size_t n, size_t align)
+{
+  struct _pool_chunk *c = p->chunks;
+  struct _pool_header *h;
+  size_t size, extra = sizeof (size_t) + sizeof *h + align;
+  char *base, *ptr;
+
+  if (n + align > LARGE_ALLOC)
+    {
+      size = _POOL_ROUND (n);
+      extra += sizeof (size_t);
+      if (_pool_over_limit (p, extra + size))
+	return 0;
+
+      base = malloc (extra + size);
+      if (base == 0) bad_malloc_handler ();
+
+      *(size_t *) base = (extra + size) | _PH_ALIGNED;
+      ptr = _ALIGN_UP (base + 2 * sizeof (size_t) + sizeof *h, align);
+      h = (struct _pool_header *) ptr - 1;
+      h->slot = _pool_register (p, base);
+      _pool_numa_bind (p, ptr, size, 0);
+      _pool_reserve (p, extra + size);
+    }
+  else
+    {
+      _size_class (n, &size);
+      if ((c == 0 || c->end - c->ptr < extra + size) &&
+	  (c = _pool_new_chunk (p, extra + size)) == 0)
+	return 0;
+
+      ptr = _ALIGN_UP (c->ptr + sizeof (size_t) + sizeof *h, align);
+      c->ptr = ptr + size;
+      h = (struct _pool_header *) ptr - 1;
+      h->slot = 0;
+    }
+
+  h->size = size | _PH_ALIGNED;
+  _PH_ALIGN (h) = align;
+
+  return ptr;
+}
+
+/* Allocate from a concurrent pool. Small blocks come from this
+ * thread's magazine for the pool if it has room, which needs no lock.
+ * Otherwise take the lock, and either reuse a freed block or carve a
+ * new magazine out of the current chunk.
+ */
+static void *
+_pool_alloc_concurrent (pool p, size_t n)
+{
+  struct _pool_magazine *m =
+    &magazines[((unsigned long) p / sizeof (struct pool)) % NR_MAGAZINES];
+  struct _pool_chunk *c;
+  struct _pool_header *h;
+  size_t size, avail;
+  int sc;
+  void *ptr;
+
+  if (n <= LARGE_ALLOC)
+    {
+      sc = _size_class (n, &size);
+
+      if (m->pool != p || m->generation != p->generation ||
+	  m->end - m->ptr < sizeof *h + size)
+	{
+	  pthread_mutex_lock (&p->lock);
+
+	  if (p->free_lists && p->free_lists[sc])
+	    {
+	      ptr = _pool_alloc (p, n);
+	      pthread_mutex_unlock (&p->lock);
+	      return ptr;
+	    }
+
+	  c = p->chunks;
+	  if ((c == 0 || c->end - c->ptr < sizeof *h + size) &&
+	      (c = _pool_new_chunk (p, sizeof *h + size)) == 0)
+	    {
+	      pthread_mutex_unlock (&p->lock);
+	      return 0;
+	    }
+	  avail = c->end - c->ptr;
+	  if (avail > MAGAZINE_SIZE)
+	    avail = MAGAZINE_SIZE;
+
+	  m->pool = p;
+	  m->generation = p->generation;
+	  m->ptr = c->ptr;
+	  m->end = c->ptr + avail;
+	  c->ptr += avail;
+
+	  pthread_mutex_unlock (&p->lock);
+	}
+
+      h = (struct _pool_header *) m->ptr;
+      m->ptr += sizeof *h + size;
+      h->size = size;
+      h->slot = 0;
+
+      return h + 1;
+    }
+
+  pthread_mutex_lock (&p->lock);
+  ptr = _pool_alloc (p, n);
+  pthread_mutex_unlock (&p->lock);
+
+  return ptr;
+}
+
+/* Release a block back to the pool. Large blocks are returned to
+ * malloc at once. A small block at the end of the current chunk is
+ * given back to the chunk, otherwise it goes on a free list.
+ */
+static void
+_pool_free (pool p, void *ptr)
+{
+  struct _pool_header *h = (struct _pool_header *) ptr - 1;
+  struct _pool_chunk *c = p->chunks;
+  size_t size;
+  int sc;
+
+  if (h->slot)
+    {
+      void *base = *h->slot;
+
+      _pool_reserve (p, -(long) _large_size (base));
+      *h->slot = 0;
+      free (base);
+    }
+  else if ((char *) ptr + _PH_SIZE (h) == c->ptr)
+    c->ptr = (char *) h;
+  else
+    {
+      /* An aligned block becomes an ordinary block of its size class. */
+      h->size = _PH_SIZE (h);
+
+      if (p->free_lists == 0)
+	{
+	  /* If the pool is at its limit, the block is simply not
+	   * reused.
+	   */
+	  p->free_lists = _pool_alloc (p, NR_SIZE_CLASSES * sizeof (void *));
+	  if (p->free_lists == 0)
+	    return;
+	  memset (p->free_lists, 0, NR_SIZE_CLASSES * sizeof (void *));
+	}
+
+      sc = _size_class (h->size, &size);
+      *(void **) ptr = p->free_lists[sc];
+      p->free_lists[sc] = ptr;
+    }
+}
+
+static inline void *
+_pool_malloc (pool p, size_t n)
+{
+  if (p->flags & POOL_CONCURRENT)
+    return _pool_alloc_concurrent (p, n);
+  else
+    return _pool_alloc (p, n);
+}
+
+void *
+pmalloc (pool p, size_t n)
+{
+  void *ptr;
+
+  ptr = _pool_malloc (p, n);
+  if (ptr == 0 && _pool_call_over_limit_handler (p))
+    ptr = _pool_malloc (p, n);
+  if (ptr == 0)
+    return 0;
+  _pool_count (p, _PH_SIZE ((struct _pool_header *) ptr - 1), n, 1);
+  PROFILE (p, n);
+
+#if DEBUG_UNINITIALISED_MEMORY
+  if (poison)
+    memset (ptr, 0xef, n);
+#endif
+
+  TRACE (p, ptr, 0, n);
+
+  return ptr;
+}
+
+void *
+pmalloc_aligned (pool p, size_t n, size_t align)
+{
+  void *ptr;
+
+  if (align & (align - 1))
+    abort ();			/* Alignment must be a power of two. */
+
+  if (align <= POOL_ALIGN)
+    return pmalloc (p, n);
+
+  _pool_lock (p);
+  ptr = _pool_alloc_aligned (p, n, align);
+  _pool_unlock (p);
+  if (ptr == 0 && _pool_call_over_limit_handler (p))
+    {
+      _pool_lock (p);
+      ptr = _pool_alloc_aligned (p, n, align);
+      _pool_unlock (p);
+    }
+  if (ptr == 0)
+    return 0;
+  _pool_count (p, _PH_SIZE ((struct _pool_header *) ptr - 1), n, 1);
+  PROFILE (p, n);
+
+#if DEBUG_UNINITIALISED_MEMORY
+  if (poison)
+    memset (ptr, 0xef, n);
+#endif
+
+  TRACE (p, ptr, 0, n);
+
+  return ptr;
+}
+
+/* Not implemented using pmalloc, so that the memory is written only
+ * once even when poisoning is enabled.
+ */
+void *
+pcalloc (pool p, size_t nmemb, size_t size)
+{
+  void *ptr;
+
+  ptr = _pool_malloc (p, nmemb * size);
+  if (ptr == 0 && _pool_call_over_limit_handler (p))
+    ptr = _pool_malloc (p, nmemb * size);
+  if (ptr == 0)
+    return 0;
+  memset (ptr, 0, nmemb * size);
+  _pool_count (p, _PH_SIZE ((struct _pool_header *) ptr - 1), nmemb * size, 1);
+  PROFILE (p, nmemb * size);
+
+  TRACE (p, ptr, 0, nmemb * size);
+
+  return ptr;
+}
+
+/* Reallocate a block in a locked pool. Returns null, leaving the old
+ * block alone, if the pool is over its limit.
+ */
+static void *
+_pool_realloc (pool p, void *ptr, size_t n)
+{
+  struct _pool_header *h, *new_h;
+  struct _pool_chunk *c;
+  size_t size, old_size;
+  void *new_ptr;
+
+  h = (struct _pool_header *) ptr - 1;
+  c = p->chunks;
+  old_size = _PH_SIZE (h);
+
+  if (h->size & _PH_ALIGNED)
+    {
+      if (n <= _PH_SIZE (h))
+	new_ptr = ptr;
+      else
+	{
+	  new_ptr = _pool_alloc_aligned (p, n, _PH_ALIGN (h));
+	  if (new_ptr == 0)
+	    return 0;
+	  memcpy (new_ptr, ptr, _PH_SIZE (h));
+	  _pool_free (p, ptr);
+	}
+    }
+  else if (h->slot)
+    {
+      if (_POOL_ROUND (n) > h->size &&
+	  _pool_over_limit (p, _POOL_ROUND (n) - h->size))
+	return 0;
+
+      new_h = realloc (h, sizeof *h + _POOL_ROUND (n));
+      if (new_h == 0) bad_malloc_handler ();
+      new_h->size = _POOL_ROUND (n);
+      *new_h->slot = new_h;
+      new_ptr = new_h + 1;
+      _pool_reserve (p, (long) new_h->size - (long) old_size);
+      if (new_h != h)
+	_pool_numa_bind (p, new_ptr, new_h->size, 1);
+    }
+  else if (n <= h->size)
+    new_ptr = ptr;
+  /* If this is the last block in the current chunk, try to grow it
+   * in place, unless it was allocated before the current mark.
+   */
+  else if (n <= LARGE_ALLOC && (char *) ptr + h->size == c->ptr &&
+	   c->ptr != p->mark_ptr &&
+	   _size_class (n, &size) >= 0 && c->end - (char *) ptr >= size)
+    {
+      c->ptr = (char *) ptr + size;
+      h->size = size;
+      new_ptr = ptr;
+    }
+  else
+    {
+      new_ptr = _pool_alloc (p, n);
+      if (new_ptr == 0)
+	return 0;
+      memcpy (new_ptr, ptr, h->size);
+      _pool_free (p, ptr);
+    }
+
+  _pool_count (p, (long) _PH_SIZE ((struct _pool_header *) new_ptr - 1)
+	       - (long) old_size, n, 1);
+
+  return new_ptr;
+}
+
+void *
+prealloc (pool p, void *ptr, size_t n)
+{
+  void *new_ptr;
+
+  if (ptr == 0)
+    return pmalloc (p, n);
+
+  _pool_lock (p);
+  new_ptr = _pool_realloc (p, ptr, n);
+  _pool_unlock (p);
+  if (new_ptr == 0 && _pool_call_over_limit_handler (p))
+    {
+      _pool_lock (p);
+      new_ptr = _pool_realloc (p, ptr, n);
+      _pool_unlock (p);
+    }
+  if (new_ptr == 0)
+    return 0;
+  PROFILE (p, n);
+
+  TRACE (p, ptr, new_ptr, n);
 
   return new_ptr;
 }
 
+void
+pfree (pool p, void *ptr)
+{
+  if (ptr == 0)
+    return;
+
+  _pool_lock (p);
+  _pool_count (p, -(long) _PH_SIZE ((struct _pool_header *) ptr - 1), 0, 0);
+  _pool_free (p, ptr);
+  _pool_unlock (p);
+
+  TRACE (p, ptr, 0, 0);
+}
+
 void
 pool_register_cleanup_fn (pool p, void (*fn) (void *), void *data)
 {
   unsigned nr_slots;
   struct _pool_cleanups *pc;
 
+  _pool_lock (p);
+
   if (_PC_SLOTS_USED (p->cleanups) < _PC_SLOTS (p->cleanups))
     {
     again:
       p->cleanups->slot[_PC_SLOTS_USED(p->cleanups)].fn = fn;
       p->cleanups->slot[_PC_SLOTS_USED(p->cleanups)].data = data;
       p->cleanups->flags++;
+      p->nr_cleanups++;
+      _pool_unlock (p);
       return;
     }
 
@@ -336,22 +1622,62 @@ pool_register_cleanup_fn (pool p, void (*fn) (void *), void *data)
   pc->next = p->cleanups;
   pc->flags = nr_slots << 16;
   p->cleanups = pc;
+  _pool_account (p, 0, sizeof (struct _pool_cleanups) +
+		 nr_slots * sizeof (struct _pool_cleanup_slot), 0);
 
   goto again;
 }
 
-void
-pool_register_malloc (pool p, void *ptr)
+int
+pool_unregister_cleanup_fn (pool p, void (*fn) (void *), void *data)
+{
+  struct _pool_cleanups *pc;
+  int i, used;
+
+  _pool_lock (p);
+
+  /* Search from the most recent cleanup backwards. The later slots in
+   * the block are moved down, so that the remaining cleanups still run
+   * in the same order.
+   */
+  for (pc = p->cleanups; pc; pc = pc->next)
+    {
+      used = _PC_SLOTS_USED (pc);
+      for (i = used - 1; i >= 0; --i)
+	if (pc->slot[i].fn == fn && pc->slot[i].data == data)
+	  {
+	    memmove (&pc->slot[i], &pc->slot[i+1],
+		     (used - i - 1) * sizeof (struct _pool_cleanup_slot));
+	    pc->flags--;
+	    p->nr_cleanups--;
+	    _pool_unlock (p);
+	    return 0;
+	  }
+    }
+
+  _pool_unlock (p);
+
+  return -1;
+}
+
+/* Record ptr in the next free slot and return the address of the
+ * slot. Slots never move, so the address remains valid until the pool
+ * is deleted.
+ */
+static void **
+_pool_register (pool p, void *ptr)
 {
   unsigned nr_slots;
   struct _pool_allocs *pa;
+  void **slot;
 
   if (_PA_SLOTS_USED (p->allocs) < _PA_SLOTS (p->allocs))
     {
     again:
-      p->allocs->slot[_PA_SLOTS_USED(p->allocs)] = ptr;
+      slot = &p->allocs->slot[_PA_SLOTS_USED(p->allocs)];
+      *slot = ptr;
       p->allocs->flags++;
-      return;
+      return slot;
     }
 
   /* Allocate a new block of slots. */
@@ -364,21 +1690,71 @@ pool_register_malloc (pool p, void *ptr)
   pa->next = p->allocs;
   pa->flags = nr_slots << 16;
   p->allocs = pa;
+  _pool_account (p, 0, sizeof (struct _pool_allocs) +
+		 nr_slots * sizeof (void *), 0);
 
   goto again;
 }
 
-static void
-_pool_close (void *fdv)
+void
+pool_register_malloc (pool p, void *ptr)
 {
-  long fd = (long) fdv;
-  close (fd);
+  if (ptr == 0)
+    return;
+
+  _pool_lock (p);
+  _pool_register (p, (void *) ((unsigned long) ptr | _SLOT_MALLOC));
+  _pool_unlock (p);
 }
 
 void
 pool_register_fd (pool p, int fd)
 {
-  pool_register_cleanup_fn (p, _pool_close, (void *) (long) fd);
+  int *fds;
+  int max_fds;
+
+  _pool_lock (p);
+
+  if (p->nr_fds == p->max_fds)
+    {
+      max_fds = p->max_fds ? p->max_fds * 2 : INITIAL_FDS;
+      fds = realloc (p->fds, max_fds * sizeof (int));
+      if (fds == 0) bad_malloc_handler ();
+      _pool_account (p, 0, (max_fds - p->max_fds) * sizeof (int), 0);
+      p->fds = fds;
+      p->max_fds = max_fds;
+    }
+
+  p->fds[p->nr_fds++] = fd;
+  p->nr_cleanups++;
+
+  _pool_unlock (p);
+}
+
+int
+pool_unregister_fd (pool p, int fd)
+{
+  int i, r = -1;
+
+  _pool_lock (p);
+
+  /* Keep the set in the order of registration, for
+   * pool_release_to_mark.
+   */
+  for (i = p->nr_fds - 1; i >= 0; --i)
+    if (p->fds[i] == fd)
+      {
+	memmove (&p->fds[i], &p->fds[i+1],
+		 (p->nr_fds - i - 1) * sizeof (int));
+	p->nr_fds--;
+	p->nr_cleanups--;
+	r = 0;
+	break;
+      }
+
+  _pool_unlock (p);
+
+  return r;
 }
 
 #ifndef NO_GLOBAL_POOL
@@ -395,6 +1771,89 @@ free_global_pool ()
 }
 #endif /* !NO_GLOBAL_POOL */
 
+void
+pool_set_flags (pool p, int flags)
+{
+  if ((flags & POOL_CONCURRENT) && !(p->flags & POOL_CONCURRENT))
+    pthread_mutex_init (&p->lock, 0);
+  else if (!(flags & POOL_CONCURRENT) && (p->flags & POOL_CONCURRENT))
+    pthread_mutex_destroy (&p->lock);
+
+  p->flags = flags;
+}
+
+int
+pool_get_flags (const pool p)
+{
+  return p->flags;
+}
+
+void
+pool_set_limit (pool p, size_t limit)
+{
+  p->limit = limit;
+}
+
+size_t
+pool_get_limit (const pool p)
+{
+  return p->limit;
+}
+
+int
+pool_set_numa_node (pool p, int node)
+{
+#ifdef HAVE_MBIND
+  if (node < POOL_NUMA_FIRST_TOUCH || node >= NUMA_MAX_NODES)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  p->numa_node = node;
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int
+pool_get_numa_node (const pool p)
+{
+  return p->numa_node;
+}
+
+void (*
+pool_set_over_limit_handler (pool p, void (*fn) (pool))) (pool)
+{
+  void (*old_fn) (pool) = p->over_limit_handler;
+  p->over_limit_handler = fn;
+  return old_fn;
+}
+
+int
+pool_set_poison (int on)
+{
+#if DEBUG_UNINITIALISED_MEMORY
+  int old = poison;
+  poison = on;
+  return old;
+#else
+  return 0;
+#endif
+}
+
+#if DEBUG_UNINITIALISED_MEMORY
+static void
+init_poison ()
+{
+  const char *str = getenv ("POOL_POISON");
+
+  if (str)
+    poison = atoi (str);
+}
+#endif
+
 void (*
 pool_set_bad_malloc_handler (void (*fn) (void))) (void)
 {
@@ -403,51 +1862,293 @@ pool_set_bad_malloc_handler (void (*fn) (void))) (void)
   return old_fn;
 }
 
-static int
-_get_struct_size (const pool p)
+/* The statistics are kept up to date as the pool is used, so this
+ * does not need to walk the subpools.
+ */
+void
+pool_get_stats (const pool p, struct pool_stats *stats, size_t n)
 {
-  pool subpool;
-  struct _pool_allocs *pa;
-  struct _pool_cleanups *pc;
-  int size;
+  struct pool_stats s;
+
+  s.nr_subpools = p->nr_subpools;
+  s.struct_size = p->struct_size;
+  s.bytes_reserved = p->bytes_reserved;
+  s.peak_bytes_reserved = p->peak_bytes_reserved;
+  s.bytes_in_use = p->bytes_in_use;
+  s.bytes_requested = p->bytes_requested;
+  s.nr_allocations = p->nr_allocations;
+  s.nr_cleanups = p->nr_cleanups;
 
-  size = sizeof (*p);
+  memcpy (stats, &s, n);
+}
 
-  for (pa = p->allocs; pa; pa = pa->next)
-    size += sizeof (struct _pool_allocs)
-            + _PA_SLOTS (pa) * sizeof (void *);
+static void
+_pool_profile_signal (int sig)
+{
+  profile_dump_requested = 1;
+}
 
-  for (pc = p->cleanups; pc; pc = pc->next)
-    size += sizeof (struct _pool_cleanups)
-            + _PC_SLOTS (pc) * sizeof (struct _pool_cleanup_slot);
+static void
+init_profile ()
+{
+  const char *str;
+  struct sigaction sa;
+  int sig = SIGUSR2;
+
+  profile_prefix = getenv ("POOL_PROFILE");
+  if (profile_prefix == 0)
+    return;
+
+  str = getenv ("POOL_PROFILE_RATE");
+  profile_rate = str ? atol (str) : PROFILE_DEFAULT_RATE;
+  if (profile_rate <= 0)
+    profile_rate = PROFILE_DEFAULT_RATE;
+
+  str = getenv ("POOL_PROFILE_SIGNAL");
+  if (str)
+    sig = atoi (str);
+  if (sig > 0)
+    {
+      memset (&sa, 0, sizeof sa);
+      sa.sa_handler = _pool_profile_signal;
+      sa.sa_flags = SA_RESTART;
+      sigaction (sig, &sa, 0);
+    }
+}
 
-  for (subpool = p->subpool_list; subpool; subpool = subpool->next)
-    size += _get_struct_size (subpool);
+/* Add count and bytes to the entry for stack in *profp, growing the
+ * profile if necessary. profile_lock must be held.
+ */
+static void
+_pool_profile_add (struct _pool_profile **profp, void **stack, int depth,
+		   unsigned long count, unsigned long bytes)
+{
+  struct _pool_profile *prof = *profp;
+  struct _pool_profile_entry *e;
+  size_t size;
+  int i, max;
+
+  if (prof)
+    for (i = 0; i < prof->nr_entries; ++i)
+      {
+	e = &prof->entry[i];
+	if (e->depth == depth &&
+	    memcmp (e->stack, stack, depth * sizeof (void *)) == 0)
+	  {
+	    e->count += count;
+	    e->bytes += bytes;
+	    return;
+	  }
+      }
+
+  if (prof == 0 || prof->nr_entries == prof->max_entries)
+    {
+      max = prof ? prof->max_entries * 2 : 16;
+      size = sizeof (struct _pool_profile) +
+	max * sizeof (struct _pool_profile_entry);
+      if (prof == 0)
+	{
+	  prof = malloc (size);
+	  if (prof == 0) bad_malloc_handler ();
+	  prof->nr_entries = 0;
+	}
+      else
+	{
+	  prof = realloc (prof, size);
+	  if (prof == 0) bad_malloc_handler ();
+	}
+      prof->max_entries = max;
+      *profp = prof;
+    }
 
-  return size;
+  e = &prof->entry[prof->nr_entries++];
+  memcpy (e->stack, stack, depth * sizeof (void *));
+  e->depth = depth;
+  e->count = count;
+  e->bytes = bytes;
 }
 
-static int
-_get_nr_subpools (const pool p)
+/* Put p on the list of pools with profiles, if it is not there
+ * already. profile_lock must be held.
+ */
+static void
+_pool_profile_link (pool p)
 {
-  pool subpool;
-  int count = 1;
+  if (p->profile_prev || profile_pools == p)
+    return;
+  p->profile_prev = 0;
+  p->profile_next = profile_pools;
+  if (profile_pools)
+    profile_pools->profile_prev = p;
+  profile_pools = p;
+}
 
-  for (subpool = p->subpool_list; subpool; subpool = subpool->next)
-    count += _get_nr_subpools (subpool);
+static void
+_pool_profile_unlink (pool p)
+{
+  if (p->profile_prev)
+    p->profile_prev->profile_next = p->profile_next;
+  else if (profile_pools == p)
+    profile_pools = p->profile_next;
+  else
+    return;
+  if (p->profile_next)
+    p->profile_next->profile_prev = p->profile_prev;
+  p->profile_next = p->profile_prev = 0;
+}
 
-  return count;
+/* Record a sampled allocation of n bytes, and choose how many bytes
+ * this thread allocates before the next sample. The gaps between
+ * samples are exponentially distributed, as pprof expects.
+ */
+static void
+_pool_profile_sample (pool p, size_t n, void *caller)
+{
+  void *stack[PROFILE_DEPTH];
+  pool sp;
+  double u;
+  int depth = 0;
+
+  if (profile_seed == 0)
+    profile_seed = time (0) ^ (unsigned long) &profile_seed;
+  u = (rand_r (&profile_seed) + 1.0) / (RAND_MAX + 2.0);
+  profile_countdown = (long) (-log (u) * profile_rate) + 1;
+
+  stack[depth++] = caller;
+  for (sp = p; sp && depth < PROFILE_DEPTH; sp = sp->parent_pool)
+    stack[depth++] = sp->creator;
+
+  pthread_mutex_lock (&profile_lock);
+  _pool_profile_add (&p->profile, stack, depth, 1, n);
+  _pool_profile_link (p);
+  pthread_mutex_unlock (&profile_lock);
+
+  if (profile_dump_requested)
+    _pool_profile_dump_all ();
 }
 
-void
-pool_get_stats (const pool p, struct pool_stats *stats, size_t n)
+/* Write a profile to a new file. profile_lock must be held. */
+static void
+_pool_profile_write (struct _pool_profile *prof)
 {
-  struct pool_stats s;
+  char filename[1024], buffer[4096];
+  unsigned long count = 0, bytes = 0;
+  struct _pool_profile_entry *e;
+  FILE *fp;
+  int i, j, fd;
+  ssize_t r;
+
+  snprintf (filename, sizeof filename, "%s.%d.%04d.heap",
+	    profile_prefix, (int) getpid (), profile_seq++);
+  fp = fopen (filename, "w");
+  if (fp == 0)
+    {
+      perror (filename);
+      return;
+    }
 
-  s.nr_subpools = _get_nr_subpools (p);
-  s.struct_size = _get_struct_size (p);
+  for (i = 0; prof && i < prof->nr_entries; ++i)
+    {
+      count += prof->entry[i].count;
+      bytes += prof->entry[i].bytes;
+    }
 
-  memcpy (stats, &s, n);
+  /* Everything in a pool stays allocated until the pool is deleted,
+   * so the in use and allocated figures are the same.
+   */
+  fprintf (fp, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%ld\n",
+	   count, bytes, count, bytes, profile_rate);
+  for (i = 0; prof && i < prof->nr_entries; ++i)
+    {
+      e = &prof->entry[i];
+      fprintf (fp, "%lu: %lu [%lu: %lu] @", e->count, e->bytes,
+	       e->count, e->bytes);
+      for (j = 0; j < e->depth; ++j)
+	fprintf (fp, " %p", e->stack[j]);
+      fprintf (fp, "\n");
+    }
+
+  /* pprof needs the memory map to find the symbols. */
+  fprintf (fp, "\nMAPPED_LIBRARIES:\n");
+  fflush (fp);
+  fd = open ("/proc/self/maps", O_RDONLY);
+  if (fd >= 0)
+    {
+      while ((r = read (fd, buffer, sizeof buffer)) > 0)
+	fwrite (buffer, 1, r, fp);
+      close (fd);
+    }
+
+  fclose (fp);
+}
+
+/* Write one profile combining all the live pools. */
+static void
+_pool_profile_dump_all ()
+{
+  struct _pool_profile *all = 0;
+  struct _pool_profile_entry *e;
+  pool p;
+  int i;
+
+  pthread_mutex_lock (&profile_lock);
+  profile_dump_requested = 0;
+  for (p = profile_pools; p; p = p->profile_next)
+    for (i = 0; i < p->profile->nr_entries; ++i)
+      {
+	e = &p->profile->entry[i];
+	_pool_profile_add (&all, e->stack, e->depth, e->count, e->bytes);
+      }
+  _pool_profile_write (all);
+  pthread_mutex_unlock (&profile_lock);
+
+  if (all)
+    free (all);
+}
+
+/* A pool is being deleted. Add its profile to its parent's, or write
+ * it out if it has no parent.
+ */
+static void
+_pool_profile_delete (pool p)
+{
+  struct _pool_profile_entry *e;
+  int i;
+
+  if (profile_dump_requested)
+    _pool_profile_dump_all ();
+
+  pthread_mutex_lock (&profile_lock);
+  if (p->profile)
+    {
+      if (p->parent_pool)
+	{
+	  for (i = 0; i < p->profile->nr_entries; ++i)
+	    {
+	      e = &p->profile->entry[i];
+	      _pool_profile_add (&p->parent_pool->profile, e->stack, e->depth,
+				 e->count, e->bytes);
+	    }
+	  _pool_profile_link (p->parent_pool);
+	}
+      else
+	_pool_profile_write (p->profile);
+
+      _pool_profile_unlink (p);
+      free (p->profile);
+      p->profile = 0;
+    }
+  pthread_mutex_unlock (&profile_lock);
+}
+
+int
+pool_dump_profile ()
+{
+  if (!profile_rate)
+    return -1;
+
+  _pool_profile_dump_all ();
+  return 0;
 }
 
 static void
@@ -458,18 +2159,38 @@ open_trace_file ()
     "Pool allocator running in trace mode.\n"
     "Trace is being saved to file ";
   char msg2[] = "\n\n";
+  const char *format;
+  struct _pool_trace_file_header header;
 
   trace_filename = getenv ("POOL_TRACE");
 
   if (trace_filename)
     {
-      trace_fd = open (trace_filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      format = getenv ("POOL_TRACE_FORMAT");
+      trace_binary = format && strcmp (format, "binary") == 0;
+
+      /* O_APPEND so that buffers flushed by different threads do not
+       * overwrite each other.
+       */
+      trace_fd = open (trace_filename, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,
+		       0644);
       if (trace_fd == -1)
 	{
 	  perror (trace_filename);
 	  exit (1);
 	}
 
+      if (trace_binary)
+	{
+	  memset (&header, 0, sizeof header);
+	  memcpy (header.magic, "POOLTRC1", 8);
+	  header.record_size = sizeof (struct _pool_trace_record);
+	  write (trace_fd, &header, sizeof header);
+
+	  clock_gettime (CLOCK_MONOTONIC, &trace_start);
+	  pthread_key_create (&trace_key, trace_flush);
+	}
+
       write (2, msg1, sizeof msg1);
       write (2, trace_filename, strlen (trace_filename));
       write (2, msg2, sizeof msg2);
@@ -477,12 +2198,77 @@ open_trace_file ()
 }
 
 static void
-trace (const char *fn, void *caller, struct pool *ptr1, void *ptr2, void *ptr3, int i1)
+close_trace_file ()
+{
+  if (trace_binary)
+    trace_flush (&trace_buffer);
+  trace_closed = 1;
+}
+
+/* Write out a thread's trace buffer. This is also the destructor for
+ * trace_key, so it runs when each thread exits.
+ */
+static void
+trace_flush (void *bv)
+{
+  struct _pool_trace_buffer *b = (struct _pool_trace_buffer *) bv;
+
+  if (b->used > 0)
+    write (trace_fd, b->record, b->used * sizeof (struct _pool_trace_record));
+  b->used = 0;
+}
+
+static void
+trace (int *fn_index, const char *fn, void *caller, struct pool *ptr1, void *ptr2, void *ptr3, long i1)
 {
   char buffer[128];
+  struct _pool_trace_buffer *b;
+  struct _pool_trace_record *r;
+  struct timespec ts;
+  int i;
+
+  if (!trace_binary)
+    {
+      sprintf (buffer,
+	       "%s caller: %p ptr1: %p ptr2: %p ptr3: %p i1: %ld\n",
+	       fn, caller, ptr1, ptr2, ptr3, i1);
+      write (trace_fd, buffer, strlen (buffer));
+      return;
+    }
+
+  /* Threads in a concurrent pool may look the name up at the same
+   * time. They all find the same index, so a plain atomic store is
+   * enough.
+   */
+  i = __atomic_load_n (fn_index, __ATOMIC_RELAXED);
+  if (i < 0)
+    {
+      for (i = 0; trace_fn_names[i]; ++i)
+	if (strcmp (trace_fn_names[i], fn) == 0)
+	  break;
+      __atomic_store_n (fn_index, i, __ATOMIC_RELAXED);
+    }
+
+  b = &trace_buffer;
+  if (b->thread == 0)
+    {
+      b->thread = __sync_add_and_fetch (&nr_trace_threads, 1);
+      pthread_setspecific (trace_key, b);
+    }
 
-  sprintf (buffer,
-	   "%s caller: %p ptr1: %p ptr2: %p ptr3: %p i1: %d\n",
-	   fn, caller, ptr1, ptr2, ptr3, i1);
-  write (trace_fd, buffer, strlen (buffer));
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  r = &b->record[b->used++];
+  r->time = (uint64_t) (ts.tv_sec - trace_start.tv_sec) * 1000000000
+    + ts.tv_nsec - trace_start.tv_nsec;
+  r->caller = (unsigned long) caller;
+  r->ptr1 = (unsigned long) ptr1;
+  r->ptr2 = (unsigned long) ptr2;
+  r->ptr3 = (unsigned long) ptr3;
+  r->i1 = i1;
+  r->fn = i;
+  r->thread = b->thread;
+
+  if (b->used == TRACE_BUFFER_RECORDS || trace_closed)
+    trace_flush (b);
 }
@@ -58,6 +58,73 @@ extern pool new_subpool (pool);
  */
 extern void delete_pool (pool);
 
+/* Function: pool_reset - empty a pool so that it can be reused
+ *
+ * Run the cleanup functions registered on the pool, delete its
+ * subpools and release all the memory allocated in it, as
+ * @ref{delete_pool(3)} would, but keep the pool itself (and one chunk
+ * of its memory) so that it can be used again. This is cheaper than
+ * deleting the pool and creating a new one, for example when a server
+ * handles one request after another in the same pool.
+ *
+ * Note that @ref{delete_pool(3)} on a subpool also keeps a few deleted
+ * subpools in the parent, so that the common sequence of
+ * @ref{new_subpool(3)}, work, @code{delete_pool} does not usually
+ * need to allocate the pool header again.
+ */
+extern void pool_reset (pool);
+
+/* Function: pool_mark - remember the state of a pool
+ * Function: pool_release_to_mark
+ *
+ * @code{pool_mark} records the current state of the pool in
+ * @code{*mark}. @code{pool_release_to_mark} later returns the pool to
+ * that state: the cleanup functions registered since the mark are run,
+ * the file descriptors registered since the mark are closed, the
+ * subpools created since the mark are deleted, and all memory
+ * allocated in the pool since the mark is released. This is useful
+ * for speculative work, such as a parser which tries one
+ * interpretation and backs off if it fails, without creating a
+ * subpool and copying the results which survive.
+ *
+ * The cost of releasing is proportional to the number of chunks of
+ * memory, large blocks and cleanups added since the mark, not to the
+ * number of small allocations.
+ *
+ * Memory allocated before the mark stays valid. Memory allocated
+ * before the mark but released with @ref{pfree(3)} or moved by
+ * @ref{prealloc(3)} after it is not reused until the pool is reset or
+ * deleted. While a mark is in effect, @ref{prealloc(3)} does not grow
+ * the block allocated just before it in place. The
+ * @code{bytes_in_use} statistic (see @ref{pool_get_stats(3)}) is set
+ * back to its value at the mark.
+ *
+ * Marks may be nested, and released in the reverse order. A mark is
+ * no longer valid once the pool is released to an earlier mark, or
+ * after @ref{pool_reset(3)}. Cleanups and file descriptors which were
+ * registered before the mark should not be unregistered before
+ * releasing to it. As with @ref{pool_reset(3)}, no other thread may
+ * be using the pool while it is released to a mark.
+ *
+ * The fields of @code{struct pool_mark} are private.
+ */
+struct pool_mark
+{
+  void *chunk;
+  void *ptr;
+  void *allocs;
+  unsigned nr_allocs;
+  void *cleanups;
+  unsigned nr_cleanup_fns;
+  int nr_fds;
+  unsigned long subpool_serial;
+  size_t bytes_in_use;
+  void *prev_mark_ptr;
+};
+
+extern void pool_mark (pool, struct pool_mark *mark);
+extern void pool_release_to_mark (pool, const struct pool_mark *mark);
+
 /* Function: pmalloc - allocate memory in a pool
  * Function: pcalloc
  * Function: prealloc
@@ -66,16 +133,26 @@ extern void delete_pool (pool);
  * (equivalent to plain @code{malloc}). If memory is allocated in a real
  * pool, then it is automatically freed when the pool is deleted.
  *
- * Memory returned is word-aligned.
+ * Memory returned is aligned to twice the size of a pointer, which is
+ * suitable for any of the basic C types.
+ *
+ * Small allocations are carved out of larger chunks of memory owned
+ * by the pool, and are all released at once when the pool is deleted.
+ * Memory returned by these functions must therefore never be passed
+ * to @ref{free(3)} or @ref{realloc(3)}.
  *
  * If a memory allocation fails, the @code{bad_malloc_handler} function is
- * called (which defaults to just calling @ref{abort(3)}).
+ * called (which defaults to just calling @ref{abort(3)}). If the pool
+ * has a limit set by @ref{pool_set_limit(3)} and the allocation would
+ * exceed it, these functions return @code{NULL} instead.
  *
  * @code{pcalloc} is identical to @code{pmalloc} but also sets the memory
  * to zero before returning it.
  *
  * @code{prealloc} increases the size of an existing memory allocation.
  * @code{prealloc} might move the memory in the process of reallocating it.
+ * @code{ptr} must have been returned by a previous call to @code{pmalloc},
+ * @code{pcalloc} or @code{prealloc} on the same pool.
  *
  * Bugs: @code{prealloc} cannot reduce the size of an existing memory
  * allocation.
@@ -84,6 +161,37 @@ extern void *pmalloc (pool, size_t n);
 extern void *pcalloc (pool, size_t nmemb, size_t size);
 extern void *prealloc (pool, void *ptr, size_t n);
 
+/* Function: pmalloc_aligned - allocate aligned memory in a pool
+ *
+ * Allocate @code{n} bytes in a pool, like @ref{pmalloc(3)}, but
+ * aligned to a multiple of @code{align} bytes, which must be a power
+ * of two. This is useful for data which will be loaded with SIMD
+ * instructions, or to make sure that a small structure sits in a
+ * single cache line.
+ *
+ * If the memory is later grown with @ref{prealloc(3)}, the new block
+ * has the same alignment. The memory may be released early with
+ * @ref{pfree(3)}.
+ */
+extern void *pmalloc_aligned (pool, size_t n, size_t align);
+
+/* Function: pfree - release memory back to a pool
+ *
+ * Release memory allocated by @ref{pmalloc(3)}, @ref{pcalloc(3)} or
+ * @ref{prealloc(3)} on pool @code{pool} before the pool is deleted.
+ * Small blocks are kept by the pool and reused by later allocations
+ * of a similar size, while large blocks are returned to the system
+ * straight away. If @code{ptr} is @code{NULL} this does nothing.
+ *
+ * It is never necessary to call @code{pfree}, but it can stop
+ * long-lived pools such as @ref{global_pool(3)} from growing when
+ * objects are repeatedly created and thrown away. @ref{prealloc(3)}
+ * releases the old block in the same way when it has to move memory.
+ *
+ * Do not use @code{ptr} after it has been released.
+ */
+extern void pfree (pool, void *ptr);
+
 /* Function: pool_register_malloc - allow pool to own malloc'd memory
  *
  * Register an anonymous area of malloc-allocated memory which
@@ -92,20 +200,178 @@ extern void *prealloc (pool, void *ptr, size_t n);
 extern void pool_register_malloc (pool, void *ptr);
 
 /* Function: pool_register_fd - allow pool to own file descriptor
+ * Function: pool_unregister_fd
  *
  * Register a file descriptor to be closed when the pool is deleted.
- * There is no way to unregister a file descriptor. If you wish to
- * do that, then you probably want to register the fd in a subpool.
+ * The file descriptors owned by a pool are kept in a set, and closed
+ * together after the pool's cleanup functions have run, using
+ * @code{close_range} for runs of consecutive descriptors where the
+ * system supports it. This makes pools which own thousands of sockets
+ * cheap to delete.
+ *
+ * @code{pool_unregister_fd} removes a file descriptor from the set
+ * without closing it, for example when it is handed to another pool
+ * or thread. It returns @code{0}, or @code{-1} if @code{fd} was not
+ * registered on this pool.
  */
 extern void pool_register_fd (pool, int fd);
+extern int pool_unregister_fd (pool, int fd);
 
 /* Function: pool_register_cleanup_fn - call function when pool is deleted
+ * Function: pool_unregister_cleanup_fn
  *
- * Register a function to be called when the pool is deleted. There
- * is no way to unregister this function. If you wish to do that, then
- * you probably want to register it in a subpool.
+ * Register a function to be called when the pool is deleted.
+ *
+ * @code{pool_unregister_cleanup_fn} removes the most recently
+ * registered cleanup with the same @code{fn} and @code{data}, without
+ * calling it. It returns @code{0}, or @code{-1} if there was no such
+ * cleanup on this pool.
  */
 extern void pool_register_cleanup_fn (pool, void (*fn) (void *), void *data);
+extern int pool_unregister_cleanup_fn (pool, void (*fn) (void *), void *data);
+
+/* Function: pool_set_flags - change the behaviour of a pool
+ * Function: pool_get_flags
+ *
+ * @code{pool_set_flags} sets the flags of a pool, which change how it
+ * behaves. Subpools created with @ref{new_subpool(3)} inherit the
+ * flags of their parent. The flags should be set when the pool has
+ * just been created, before it is shared with other threads.
+ *
+ * @code{pool_get_flags} returns the current flags.
+ *
+ * The following flags are defined:
+ *
+ * @code{POOL_CONCURRENT}: The pool may be used by several threads at
+ * the same time. Allocating, reallocating and freeing memory,
+ * registering cleanups and creating or deleting subpools are all
+ * safe. Each thread allocates small blocks from its own magazine of
+ * memory taken from the pool, so threads do not contend on the pool
+ * lock for most calls to @ref{pmalloc(3)}. Deleting the pool while
+ * other threads are still using it or its subpools is not safe.
+ *
+ * A common pattern is for each worker thread to create its own
+ * subpool of a shared concurrent pool. To make @ref{global_pool(3)}
+ * safe for this, call @code{pool_set_flags (global_pool,
+ * POOL_CONCURRENT)} before starting any threads.
+ *
+ * @code{POOL_MMAP}: For pools which will hold a lot of memory. Chunks
+ * of memory for small allocations grow to 2 MB instead of 64 KB, and
+ * those of 64 KB or more are obtained with @ref{mmap(2)} instead of
+ * @code{malloc}, so that deleting the pool returns them to the
+ * operating system straight away. Large allocations still use
+ * @code{malloc}, which normally maps very large blocks itself.
+ *
+ * @code{POOL_HUGEPAGES}: Like @code{POOL_MMAP}, but mmap'd chunks are
+ * whole 2 MB huge pages, and the kernel is asked to back them with
+ * transparent huge pages (@code{MADV_HUGEPAGE}). This reduces TLB
+ * misses in pools which hold gigabytes of data.
+ *
+ * @code{POOL_HUGETLB}: Like @code{POOL_HUGEPAGES}, but explicit huge
+ * pages are used (@code{MAP_HUGETLB}) if the system has any reserved.
+ * Otherwise this behaves like @code{POOL_HUGEPAGES}.
+ *
+ * On systems without @ref{mmap(2)}, the last three flags have no
+ * effect.
+ */
+#define POOL_CONCURRENT 0x0001
+#define POOL_MMAP       0x0002
+#define POOL_HUGEPAGES  0x0004
+#define POOL_HUGETLB    0x0008
+
+extern void pool_set_flags (pool, int flags);
+extern int pool_get_flags (const pool);
+
+/* Function: pool_set_poison - turn poisoning of new memory on or off
+ *
+ * By default, @ref{pmalloc(3)} fills newly allocated memory with
+ * @code{0xef} bytes, so that code which uses uninitialised memory
+ * fails in an obvious way. This is useful while debugging, but costs
+ * an extra pass over every allocation. @ref{pcalloc(3)} does not
+ * poison memory, since it sets it to zero anyway.
+ *
+ * Poisoning can be turned off (@code{on == 0}) or back on
+ * (@code{on != 0}) with this function, or at program start by
+ * setting the environment variable @code{POOL_POISON} to @code{0} or
+ * @code{1}. The library can also be built without poisoning at all
+ * by defining @code{DEBUG_UNINITIALISED_MEMORY} to @code{0}, in which
+ * case this function has no effect.
+ *
+ * This function returns the previous setting.
+ */
+extern int pool_set_poison (int on);
+
+/* Function: pool_set_numa_node - choose where a pool's memory is placed
+ * Function: pool_get_numa_node
+ *
+ * On machines with several NUMA nodes, memory is normally placed on
+ * the node of the thread which first touches it, or according to the
+ * policy of the process. A pool created by one thread and used by
+ * worker threads on another node may then hold mostly remote memory.
+ *
+ * @code{pool_set_numa_node} asks for future memory in the pool to be
+ * placed on NUMA node @code{node}. If the node is full, memory comes
+ * from other nodes instead. @code{node} may also be
+ * @code{POOL_NUMA_FIRST_TOUCH}, which places each page on the node of
+ * the thread which first writes to it, whatever the policy of the
+ * process, or @code{POOL_NUMA_DEFAULT} (the default) to leave
+ * placement to the system.
+ *
+ * A pool with a NUMA placement gets its memory as if
+ * @code{POOL_MMAP} were set (see @ref{pool_set_flags(3)}). The policy
+ * applies to chunks of 64 KB or more and to whole pages of large
+ * blocks, which is where almost all the memory of a large pool lives.
+ * The first few small chunks of a pool are not affected. Subpools
+ * created afterwards inherit the setting.
+ *
+ * @code{pool_set_numa_node} returns @code{0} on success, or
+ * @code{-1} with @code{errno} set to @code{EINVAL} if @code{node} is
+ * not valid, or @code{ENOSYS} if the system does not support memory
+ * policies. @code{pool_get_numa_node} returns the current setting.
+ */
+#define POOL_NUMA_DEFAULT     (-1)
+#define POOL_NUMA_FIRST_TOUCH (-2)
+
+extern int pool_set_numa_node (pool, int node);
+extern int pool_get_numa_node (const pool);
+
+/* Function: pool_set_limit - limit the memory used by a pool
+ * Function: pool_get_limit
+ * Function: pool_set_over_limit_handler
+ *
+ * @code{pool_set_limit} limits the number of bytes which the pool and
+ * all its subpools, including ones created later, may obtain from
+ * @code{malloc}. This is the @code{bytes_reserved} figure reported by
+ * @ref{pool_get_stats(3)}. Memory is obtained in chunks, so the limit
+ * is checked when a new chunk or a large block is needed, rather than
+ * on every allocation. A @code{limit} of @code{0} (the default) means
+ * no limit.
+ *
+ * @code{pool_get_limit} returns the current limit.
+ *
+ * When an allocation would take a pool or any of its ancestors over
+ * its limit, the over-limit handler of the pool being allocated from
+ * is called. The handler may release memory, for example by calling
+ * @ref{pool_reset(3)} on a pool holding cached data, in which case the
+ * allocation is tried once more. If there is no handler, or the
+ * allocation still fails, then @ref{pmalloc(3)}, @ref{pcalloc(3)},
+ * @ref{prealloc(3)} and @ref{pmalloc_aligned(3)} return @code{NULL},
+ * and @code{prealloc} leaves the old block alone. The handler is
+ * called without the pool locked, so it may use the pool.
+ *
+ * Note that other functions in this library which allocate from a
+ * pool, such as those which grow vectors and hashes, do not check for
+ * @code{NULL}. Pools passed to them should have a handler which does
+ * not return, for example one which calls @ref{longjmp(3)} to abandon
+ * the request being served.
+ *
+ * @code{new_subpool} gives each subpool the over-limit handler of its
+ * parent, but no limit of its own. @code{pool_set_over_limit_handler}
+ * returns the previous handler. The default is no handler.
+ */
+extern void pool_set_limit (pool, size_t limit);
+extern size_t pool_get_limit (const pool);
+extern void (*pool_set_over_limit_handler (pool, void (*fn) (pool))) (pool);
 
 /* Function: pool_set_bad_malloc_handler - set handler for when malloc fails
  *
@@ -120,6 +386,12 @@ struct pool_stats
 {
   int nr_subpools;
   int struct_size;
+  size_t bytes_reserved;
+  size_t peak_bytes_reserved;
+  size_t bytes_in_use;
+  size_t bytes_requested;
+  unsigned long nr_allocations;
+  int nr_cleanups;
 };
 
 /* Function: pool_get_stats - get statistics from the pool
@@ -127,7 +399,12 @@ struct pool_stats
  * Return various statistics collected for the pool. This function
  * fills in the @code{stats} argument which should point to a
  * structure of type @code{struct pool_stats}. @code{n} should be
- * set to the size of this structure.
+ * set to the size of this structure. Programs compiled against an
+ * older, shorter @code{struct pool_stats} only get the fields they
+ * know about.
+ *
+ * The statistics are maintained as the pool is used, so this call
+ * is cheap enough to make often, for example to export metrics.
  *
  * @code{struct pool_stats} currently contains the following fields:
  *
@@ -135,9 +412,57 @@ struct pool_stats
  *
  * @code{struct_size}: The memory overhead used by the pool allocator
  * itself to store structures. This includes subpools.
+ *
+ * @code{bytes_reserved}: The number of bytes currently obtained from
+ * @code{malloc} to hold blocks allocated from the pool and its
+ * subpools. Memory registered with @code{pool_register_malloc} is not
+ * included, since its size is not known. Deleted subpools which are
+ * kept for reuse by @code{new_subpool} are included.
+ *
+ * @code{peak_bytes_reserved}: The largest value @code{bytes_reserved}
+ * has had since the pool was created.
+ *
+ * @code{bytes_in_use}: The total size of the blocks currently
+ * allocated directly from this pool, after rounding up. Subpools are
+ * not included.
+ *
+ * @code{bytes_requested}: The total number of bytes asked for by
+ * calls to @code{pmalloc}, @code{pcalloc}, @code{pmalloc_aligned} and
+ * @code{prealloc} on this pool.
+ *
+ * @code{nr_allocations}: The number of those calls.
+ *
+ * @code{nr_cleanups}: The number of cleanup functions (including file
+ * descriptors) registered on this pool and not yet run.
+ *
+ * The last four fields are reset to zero by @code{pool_reset}.
  */
 extern void pool_get_stats (const pool, struct pool_stats *stats, size_t n);
 
+/* Function: pool_dump_profile - write out the allocation profile
+ *
+ * The pool allocator contains a sampling profiler which shows where
+ * pool memory is being allocated. It is turned on by setting the
+ * environment variable @code{POOL_PROFILE} to a filename prefix
+ * before the program starts. About once every
+ * @code{POOL_PROFILE_RATE} bytes (default 524288) an allocation is
+ * sampled, and the pool it came from counts the sample against the
+ * calling function and the places where the pool and its parents
+ * were created.
+ *
+ * When a subpool is deleted its samples are added to its parent's.
+ * When a pool without a parent is deleted, its samples are written to
+ * a file called @code{<prefix>.<pid>.<seq>.heap}, in the heap profile
+ * format read by @code{pprof}. Sending the program the signal
+ * @code{POOL_PROFILE_SIGNAL} (default @code{SIGUSR2}; @code{0} means
+ * do not catch any signal) writes a profile of all the live pools the
+ * next time a sample is taken or a pool is deleted.
+ *
+ * This function writes a profile of all the live pools immediately.
+ * It returns @code{0}, or @code{-1} if profiling is not turned on.
+ */
+extern int pool_dump_profile (void);
+
 /* Obsolete calls for backwards compatibility. These will be removed soon. */
 #define pool_get_size(p) (-1)
 #define pool_get_areas(p) (-1)
@@ -358,15 +358,21 @@ pvsprintf (pool pool, const char *format, va_list args)
 {
 #ifdef HAVE_VASPRINTF
 
-  char *s;
+  char *s, *t;
+  int n;
 
-  vasprintf (&s, format, args);
-  if (s == 0) abort ();		/* XXX Should call bad_malloc_handler. */
+  n = vasprintf (&s, format, args);
+  if (n < 0) abort ();		/* XXX Should call bad_malloc_handler. */
 
-  /* The pool will clean up the malloc when it goes. */
-  pool_register_malloc (pool, s);
+  /* Copy the result into the pool so that it carries a pool header
+   * and can be passed to prealloc (eg. by pstrcat) like any other
+   * pool string.
+   */
+  t = pmalloc (pool, n + 1);
+  memcpy (t, s, n + 1);
+  free (s);
 
-  return s;
+  return t;
 
 #else /* !HAVE_VASPRINTF */
 
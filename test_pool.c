@@ -24,6 +24,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 /* Implement a simple malloc debugger -- which counts allocations and
  * frees and ensures that all memory allocated by the pool code is
@@ -33,6 +34,7 @@
 static void  trace_init (void);
 static void  trace_finish (void);
 static void *trace_malloc (size_t n, const char *filename, int line);
+static int nr_allocations = 0;
 static void *trace_realloc (void *p, size_t n, const char *filename, int line);
 static void  trace_free (void *p);
 
@@ -83,6 +85,140 @@ simple_alloc_test ()
   delete_pool (p);
 }
 
+/* Check that prealloc preserves the contents of blocks, both when they
+ * are grown in place at the end of a chunk and when they are moved.
+ */
+static void
+prealloc_contents_test ()
+{
+  pool p;
+  char *a, *b;
+  int i, n;
+
+  p = new_pool ();
+
+  a = pmalloc (p, 1);
+  a[0] = 0;
+  for (n = 1; n < 10000; ++n)
+    {
+      a = prealloc (p, a, n + 1);
+      a[n] = n & 0x7f;
+
+      /* Interleave another allocation so that a is not always the
+       * last block in the chunk.
+       */
+      if ((n & 15) == 0)
+	{
+	  b = pmalloc (p, n & 0xff);
+	  memset (b, 0, n & 0xff);
+	}
+    }
+
+  for (i = 0; i < 10000; ++i)
+    assert (a[i] == (i & 0x7f));
+
+  delete_pool (p);
+}
+
+/* Memory released with pfree (or by prealloc moving a block) should be
+ * reused, so that a pool with a steady working set stops growing.
+ */
+static void
+pfree_test ()
+{
+  pool p;
+  void *ptrs[64];
+  struct _pool_chunk *c;
+  int i, j, nr_chunks;
+
+  p = new_pool ();
+  memset (ptrs, 0, sizeof ptrs);
+
+  for (i = 0; i < 100000; ++i)
+    {
+      j = (i * 7) & 63;
+      pfree (p, ptrs[j]);
+      ptrs[j] = pmalloc (p, 1 + (i * 13) % 2000);
+      if (i & 1)
+	ptrs[j] = prealloc (p, ptrs[j], 1 + (i * 17) % 3000);
+    }
+
+  for (nr_chunks = 0, c = p->chunks; c; c = c->next)
+    nr_chunks++;
+  assert (nr_chunks < 20);
+
+  /* Large blocks are freed immediately. */
+  for (i = 0; i < 64; ++i)
+    {
+      pfree (p, ptrs[i]);
+      ptrs[i] = pmalloc (p, LARGE_ALLOC * 2);
+    }
+  for (i = 0; i < 64; ++i)
+    pfree (p, ptrs[i]);
+  pfree (p, 0);
+
+  delete_pool (p);
+}
+
+static void
+poison_test ()
+{
+  pool p;
+  unsigned char *ptr;
+  int i;
+
+  p = new_pool ();
+
+  pool_set_poison (1);
+  ptr = pmalloc (p, 100);
+#if DEBUG_UNINITIALISED_MEMORY
+  for (i = 0; i < 100; ++i)
+    assert (ptr[i] == 0xef);
+#endif
+  pfree (p, ptr);
+
+  ptr = pcalloc (p, 10, 10);
+  for (i = 0; i < 100; ++i)
+    assert (ptr[i] == 0);
+
+  assert (pool_set_poison (0) == DEBUG_UNINITIALISED_MEMORY);
+  pmalloc (p, 100);
+  pool_set_poison (1);
+
+  delete_pool (p);
+}
+
+static void
+aligned_test ()
+{
+  pool p;
+  char *ptr;
+  size_t align, n;
+  int i;
+
+  p = new_pool ();
+
+  for (align = 1; align <= 4096; align *= 2)
+    for (n = 1; n < 3 * LARGE_ALLOC; n = n * 3 + 1)
+      {
+	ptr = pmalloc_aligned (p, n, align);
+	assert (((unsigned long) ptr & (align - 1)) == 0);
+	memset (ptr, 0x5a, n);
+	pmalloc (p, 1);
+
+	/* Growing the block keeps it aligned. */
+	ptr = prealloc (p, ptr, n * 5);
+	assert (((unsigned long) ptr & (align - 1)) == 0);
+	for (i = 0; i < n; ++i)
+	  assert (ptr[i] == 0x5a);
+
+	if (n & 1)
+	  pfree (p, ptr);
+      }
+
+  delete_pool (p);
+}
+
 static void
 simple_subpool_test (pool parent, int level)
 {
@@ -167,10 +303,439 @@ cleanup_fn_test ()
   assert (cleanup_called == 4);
 }
 
+static void
+reset_test ()
+{
+  pool p, sp;
+  struct _pool_chunk *c;
+  int i, n;
+
+  cleanup_called = 0;
+
+  p = new_pool ();
+  for (i = 0; i < 100; ++i)
+    {
+      sp = new_subpool (p);
+      pool_register_cleanup_fn (p, cleanup_fn, 0);
+      pool_register_cleanup_fn (sp, cleanup_fn, 0);
+      pmalloc (p, 100);
+      pfree (p, pmalloc (p, 10));
+      pmalloc (p, LARGE_ALLOC * 2);
+
+      c = p->chunks;
+      pool_reset (p);
+      assert (cleanup_called == 2 * (i+1));
+      assert (p->subpool_list == 0);
+      assert (p->chunks == c && c->next == 0);
+    }
+  delete_pool (p);
+
+  /* In steady state, creating and deleting a subpool which does a
+   * little work should not need to call malloc at all.
+   */
+  p = new_pool ();
+  for (i = 0; i < 100; ++i)
+    {
+      n = nr_allocations;
+      sp = new_subpool (p);
+      pmalloc (sp, 100);
+      pmalloc (new_subpool (sp), 100);
+      delete_pool (sp);
+      assert (i < 2 || nr_allocations == n);
+    }
+  delete_pool (p);
+}
+
+/* Check that the statistics of p agree with its subpools, and return
+ * the number of bytes reserved.
+ */
+static size_t
+check_stats (pool p)
+{
+  pool sp;
+  size_t reserved = p->own_reserved;
+  int nr_subpools = 1;
+
+  for (sp = p->subpool_list; sp; sp = sp->next)
+    {
+      reserved += check_stats (sp);
+      nr_subpools += sp->nr_subpools;
+    }
+  for (sp = p->recycled_list; sp; sp = sp->next)
+    reserved += check_stats (sp);
+
+  assert (p->bytes_reserved == reserved);
+  assert (p->peak_bytes_reserved >= reserved);
+  assert (p->nr_subpools == nr_subpools);
+  return reserved;
+}
+
+static void
+stats_test ()
+{
+  pool p, sp, subpools[20];
+  struct pool_stats s;
+  void *ptr;
+  int i, j;
+
+  p = new_pool ();
+  pool_get_stats (p, &s, sizeof s);
+  assert (s.nr_subpools == 1);
+  assert (s.bytes_reserved == 0 && s.bytes_in_use == 0);
+  assert (s.nr_allocations == 0 && s.nr_cleanups == 0);
+
+  pmalloc (p, 10);
+  pcalloc (p, 10, 3);
+  ptr = pmalloc (p, 10000);
+  pool_register_cleanup_fn (p, cleanup_fn, 0);
+  pool_get_stats (p, &s, sizeof s);
+  assert (s.bytes_requested == 10 + 30 + 10000);
+  assert (s.nr_allocations == 3);
+  assert (s.bytes_in_use == 16 + 32 + 10000);
+  assert (s.bytes_reserved ==
+	  INITIAL_CHUNK_SIZE + sizeof (struct _pool_header) + 10000);
+  assert (s.nr_cleanups == 1);
+
+  pfree (p, ptr);
+  pool_get_stats (p, &s, sizeof s);
+  assert (s.bytes_in_use == 16 + 32);
+  assert (s.bytes_reserved == INITIAL_CHUNK_SIZE);
+  assert (s.peak_bytes_reserved ==
+	  INITIAL_CHUNK_SIZE + sizeof (struct _pool_header) + 10000);
+
+  /* A caller built against an older struct pool_stats gets only the
+   * fields it knows about.
+   */
+  memset (&s, 0, sizeof s);
+  pool_get_stats (p, &s, 2 * sizeof (int));
+  assert (s.nr_subpools == 1 && s.bytes_reserved == 0);
+
+  /* Build and tear down a random tree of subpools. */
+  for (i = 0; i < 20; ++i)
+    {
+      subpools[i] = new_subpool (i == 0 ? p : subpools[rand () % i]);
+      for (j = 0; j < 50; ++j)
+	{
+	  ptr = pmalloc_aligned (subpools[i], rand () % 6000, 64);
+	  ptr = prealloc (subpools[i], ptr, rand () % 6000);
+	  if (j & 1)
+	    pfree (subpools[i], ptr);
+	  pmalloc (subpools[i], rand () % 6000);
+	  pool_register_cleanup_fn (subpools[i], cleanup_fn, 0);
+	}
+      check_stats (p);
+    }
+  pool_get_stats (p, &s, sizeof s);
+  assert (s.nr_subpools == 21);
+  assert (s.struct_size > sizeof (struct pool) * 21);
+  assert (s.bytes_in_use == 16 + 32);
+
+  for (i = 19; i >= 0; i -= 3)
+    {
+      delete_pool (subpools[i]);
+      check_stats (p);
+    }
+  sp = new_subpool (p);
+  pmalloc (sp, 100);
+  check_stats (p);
+
+  pool_reset (p);
+  check_stats (p);
+  pool_get_stats (p, &s, sizeof s);
+  assert (s.nr_subpools == 1);
+  assert (s.bytes_in_use == 0 && s.nr_allocations == 0);
+  assert (s.nr_cleanups == 0);
+  delete_pool (p);
+}
+
+static int over_limit_called;
+static pool cache_pool;
+
+static void
+over_limit_handler (pool p)
+{
+  over_limit_called++;
+  if (cache_pool)
+    pool_reset (cache_pool);
+}
+
+static void
+limit_test ()
+{
+  pool p, sp, sp2;
+  struct pool_stats s;
+  void *ptr;
+  int i;
+
+  /* A subpool cannot take its parent over the parent's limit. */
+  p = new_pool ();
+  pool_set_limit (p, 100000);
+  assert (pool_get_limit (p) == 100000);
+  sp = new_subpool (p);
+  assert (pool_get_limit (sp) == 0);
+  for (i = 0; i < 1000; ++i)
+    if (pmalloc (sp, 1000) == 0)
+      break;
+  assert (i > 50 && i < 100);
+  assert (pmalloc (sp, 50000) == 0);
+  assert (pcalloc (sp, 500, 100) == 0);
+  assert (pmalloc_aligned (sp, 50000, 64) == 0);
+  pool_get_stats (p, &s, sizeof s);
+  assert (s.bytes_reserved <= 100000);
+
+  /* prealloc fails softly and leaves the block alone. */
+  ptr = pmalloc (p, 8);
+  memset (ptr, 'x', 8);
+  assert (prealloc (p, ptr, 50000) == 0);
+  assert (memcmp (ptr, "xxxxxxxx", 8) == 0);
+
+  /* Freeing memory makes room again. */
+  delete_pool (sp);
+  assert (pmalloc (p, 10000) != 0);
+  delete_pool (p);
+
+  /* The handler is inherited, and can release memory so that the
+   * allocation succeeds when it is tried again.
+   */
+  over_limit_called = 0;
+  p = new_pool ();
+  pool_set_limit (p, 200000);
+  assert (pool_set_over_limit_handler (p, over_limit_handler) == 0);
+  cache_pool = new_subpool (p);
+  sp = new_subpool (p);
+  sp2 = new_subpool (sp);
+  for (i = 0; i < 10; ++i)
+    pmalloc (cache_pool, 10000);
+  for (i = 0; i < 15; ++i)
+    assert (pmalloc (sp2, 10000) != 0);
+  assert (over_limit_called == 1);
+  cache_pool = 0;
+  assert (pmalloc (sp2, 300000) == 0);
+  delete_pool (p);
+}
+
+static void
+mapped_test (int flags)
+{
+  pool p, sp;
+  struct _pool_chunk *c;
+  int i, nr_chunks = 0, nr_mapped = 0, n;
+
+  n = nr_allocations;
+  p = new_pool ();
+  pool_set_flags (p, flags);
+  for (i = 0; i < 200000; ++i)
+    pmalloc (p, 50);
+
+  for (c = p->chunks; c; c = c->next)
+    {
+      nr_chunks++;
+      if (c->mapped)
+	{
+	  nr_mapped++;
+	  assert (c->end - (char *) c <= MAX_MAPPED_CHUNK_SIZE);
+	  if (flags != POOL_MMAP)
+	    assert (((unsigned long) c & (HUGE_PAGE_SIZE - 1)) == 0);
+	}
+    }
+  assert (nr_mapped > 0 && nr_chunks < 20);
+  check_stats (p);
+
+  /* Subpools inherit the flag, and do not keep a mapped chunk when
+   * they are deleted.
+   */
+  sp = new_subpool (p);
+  assert (pool_get_flags (sp) == flags);
+  for (i = 0; i < 10000; ++i)
+    pmalloc (sp, 50);
+  assert (sp->chunks->mapped);
+  delete_pool (sp);
+  assert (p->recycled_list == sp && sp->chunks == 0);
+  check_stats (p);
+
+  /* Only the two pool structures and the small chunks are malloc'd. */
+  assert (nr_allocations - n == 2 + nr_chunks - nr_mapped);
+
+  pool_reset (p);
+  check_stats (p);
+  delete_pool (p);
+}
+
+static void
+numa_test ()
+{
+  pool p;
+#ifdef HAVE_MBIND
+  pool sp;
+  char *ptr;
+  int mode = -1;
+  unsigned long mask[NUMA_MAX_NODES / (8 * sizeof (long))];
+#endif
+
+  p = new_pool ();
+  assert (pool_get_numa_node (p) == POOL_NUMA_DEFAULT);
+#ifndef HAVE_MBIND
+  assert (pool_set_numa_node (p, 0) == -1 && errno == ENOSYS);
+#else
+  assert (pool_set_numa_node (p, -3) == -1 && errno == EINVAL);
+  assert (pool_set_numa_node (p, 0) == 0);
+  assert (pool_get_numa_node (p) == 0);
+
+  sp = new_subpool (p);
+  assert (pool_get_numa_node (sp) == 0);
+  ptr = pmalloc (sp, 1000000);
+  ptr = prealloc (sp, ptr, 3000000);
+
+  /* The large block should prefer node 0. */
+  memset (mask, 0, sizeof mask);
+  if (syscall (SYS_get_mempolicy, &mode, mask, NUMA_MAX_NODES + 1,
+	       ptr + 2000000, 2 /* MPOL_F_ADDR */) == 0)
+    assert (mode == _MPOL_PREFERRED && mask[0] == 1);
+
+  assert (pool_set_numa_node (sp, POOL_NUMA_FIRST_TOUCH) == 0);
+  assert (pool_get_numa_node (new_subpool (sp)) == POOL_NUMA_FIRST_TOUCH);
+  pmalloc (sp, 1000000);
+  check_stats (p);
+#endif
+  delete_pool (p);
+}
+
+static void
+mark_test ()
+{
+  pool p, sp;
+  struct pool_mark m1, m2;
+  struct pool_stats s1, s2;
+  char *small, *large;
+  void *m;
+  int i, j, n, fd, fds[5];
+
+  cleanup_called = 0;
+  p = new_pool ();
+  small = pmalloc (p, 10);
+  strcpy (small, "small");
+  large = pmalloc (p, 10000);
+  strcpy (large, "large");
+  pool_register_cleanup_fn (p, cleanup_fn, 0);
+  fd = open ("/dev/null", O_RDONLY);
+  pool_register_fd (p, fd);
+  sp = new_subpool (p);
+
+  n = nr_allocations;
+  pool_get_stats (p, &s1, sizeof s1);
+  pool_mark (p, &m1);
+
+  for (i = 0; i < 10000; ++i)
+    pmalloc (p, i % 100);
+  pfree (p, pmalloc (p, 50));
+  pfree (p, pmalloc (p, 50000));
+  pmalloc (p, 50000);
+  pmalloc_aligned (p, 20000, 64);
+  large = prealloc (p, large, 20000);
+  m = malloc (10);
+  pool_register_malloc (p, m);
+  for (i = 0; i < 20; ++i)
+    pool_register_cleanup_fn (p, cleanup_fn, 0);
+  for (i = 0; i < 5; ++i)
+    {
+      fds[i] = open ("/dev/null", O_RDONLY);
+      pool_register_fd (p, fds[i]);
+    }
+  for (i = 0; i < 3; ++i)
+    pmalloc (new_subpool (p), 100);
+
+  /* Nested marks. */
+  pool_mark (p, &m2);
+  for (i = 0; i < 100; ++i)
+    pmalloc (p, 1000);
+  pool_register_cleanup_fn (p, cleanup_fn, 0);
+  pool_release_to_mark (p, &m2);
+  assert (cleanup_called == 1);
+  check_stats (p);
+
+  pool_release_to_mark (p, &m1);
+  assert (cleanup_called == 21);
+  for (i = 0; i < 5; ++i)
+    assert (close (fds[i]) == -1 && errno == EBADF);
+  assert (p->subpool_list == sp && sp->next == 0);
+  assert (strcmp (small, "small") == 0 && strcmp (large, "large") == 0);
+  check_stats (p);
+  pool_get_stats (p, &s2, sizeof s2);
+  assert (p->own_reserved == s1.bytes_reserved + 20000 - 10000);
+  assert (s2.bytes_in_use == s1.bytes_in_use);
+  assert (s2.nr_cleanups == s1.nr_cleanups);
+  /* Deleted subpools are kept for reuse, with one chunk each. */
+  assert (nr_allocations == n + 2 * p->nr_recycled);
+
+  /* Speculative allocation in a loop does not use more memory. */
+  pool_mark (p, &m1);
+  for (i = 0; i < 1000; ++i)
+    {
+      for (j = 0; j < 100; ++j)
+	pmalloc (p, 1 + j * 50);
+      pool_release_to_mark (p, &m1);
+    }
+  pool_get_stats (p, &s1, sizeof s1);
+  assert (s1.bytes_reserved < s2.bytes_reserved + 2 * MAX_CHUNK_SIZE);
+
+  /* A block allocated before the mark is not grown in place over
+   * memory which is handed out again after releasing to the mark.
+   */
+  small = pmalloc (p, 16);
+  pool_mark (p, &m1);
+  prealloc (p, small, 200);
+  pool_release_to_mark (p, &m1);
+  large = pmalloc (p, 64);
+  memset (large, 'x', 64);
+  assert (large >= small + 16 || large + 64 <= small);
+  small = prealloc (p, small, 100);
+  memset (small, 'y', 100);
+  for (i = 0; i < 64; ++i)
+    assert (large[i] == 'x');
+  check_stats (p);
+
+  delete_pool (p);
+  assert (cleanup_called == 22);
+  assert (close (fd) == -1 && errno == EBADF);
+}
+
+/* Create a million subpools and delete them in random order. This
+ * would take quadratic time if deleting a subpool had to search the
+ * parent's list.
+ */
+static void
+random_delete_test ()
+{
+  const int n = 1000000;
+  pool p, *subpools, tmp;
+  int i, j;
+
+  p = new_pool ();
+  subpools = pmalloc (p, n * sizeof (pool));
+
+  for (i = 0; i < n; ++i)
+    subpools[i] = new_subpool (p);
+
+  srandom (1);
+  for (i = n - 1; i > 0; --i)
+    {
+      j = random () % (i + 1);
+      tmp = subpools[i];
+      subpools[i] = subpools[j];
+      subpools[j] = tmp;
+    }
+
+  for (i = 0; i < n; ++i)
+    delete_pool (subpools[i]);
+  assert (p->subpool_list == 0);
+
+  delete_pool (p);
+}
+
 static void
 cleanup_fd_test ()
 {
-  int fd;
+  int fd, fds[100], i;
   pool p;
 
   p = new_pool ();
@@ -179,6 +744,46 @@ cleanup_fd_test ()
   delete_pool (p);
 
   assert (close (fd) == -1 && errno == EBADF);
+
+  /* Many descriptors, mostly consecutive, with some handed off. */
+  p = new_pool ();
+  for (i = 0; i < 100; ++i)
+    {
+      fds[i] = open ("/dev/null", O_RDONLY);
+      assert (fds[i] >= 0);
+      pool_register_fd (p, fds[i]);
+    }
+  for (i = 0; i < 100; i += 7)
+    assert (pool_unregister_fd (p, fds[i]) == 0);
+  assert (pool_unregister_fd (p, fds[0]) == -1);
+  check_stats (p);
+  delete_pool (p);
+
+  for (i = 0; i < 100; ++i)
+    if (i % 7 == 0)
+      assert (close (fds[i]) == 0);
+    else
+      assert (close (fds[i]) == -1 && errno == EBADF);
+}
+
+static void
+unregister_cleanup_test ()
+{
+  pool p;
+  int i;
+
+  cleanup_called = 0;
+  p = new_pool ();
+  for (i = 0; i < 10; ++i)
+    pool_register_cleanup_fn (p, cleanup_fn, 0);
+  pool_register_cleanup_fn (p, cleanup_fn, p);
+  for (i = 0; i < 4; ++i)
+    assert (pool_unregister_cleanup_fn (p, cleanup_fn, 0) == 0);
+  assert (pool_unregister_cleanup_fn (p, cleanup_fn, p) == 0);
+  assert (pool_unregister_cleanup_fn (p, cleanup_fn, p) == -1);
+  assert (p->nr_cleanups == 6);
+  delete_pool (p);
+  assert (cleanup_called == 6);
 }
 
 static void
@@ -225,16 +830,207 @@ lots_of_pmalloc_test ()
   delete_pool (p);
 }
 
+/* Several threads allocate from a shared concurrent pool and from
+ * their own subpools of it, and check that no two threads were handed
+ * the same memory.
+ */
+#define NR_THREADS 8
+
+/* Each thread stamps its blocks with its own id. */
+struct concurrent_arg
+{
+  pool pool;
+  int id;
+};
+
+static void *
+concurrent_worker (void *vp)
+{
+  struct concurrent_arg *arg = vp;
+  pool parent = arg->pool;
+  pool sp;
+  unsigned char *ptrs[100];
+  int i, j, k, id = arg->id;
+
+  for (i = 0; i < 100; ++i)
+    {
+      sp = new_subpool (parent);
+
+      for (j = 0; j < 100; ++j)
+	{
+	  ptrs[j] = pmalloc (parent, 1 + j * 3);
+	  ptrs[j] = prealloc (parent, ptrs[j], 1 + j * 70);
+	  memset (ptrs[j], id, 1 + j * 70);
+	  memset (pmalloc (sp, 1 + j), 0, 1 + j);
+	}
+
+      for (j = 0; j < 100; ++j)
+	{
+	  for (k = 0; k < 1 + j * 70; ++k)
+	    assert (ptrs[j][k] == id);
+	  if (j & 1)
+	    pfree (parent, ptrs[j]);
+	}
+
+      if (i & 1)
+	delete_pool (sp);
+    }
+
+  return 0;
+}
+
+static void
+concurrent_test ()
+{
+  pool p;
+  pthread_t threads[NR_THREADS];
+  struct concurrent_arg args[NR_THREADS];
+  int i;
+
+  p = new_pool ();
+  pool_set_flags (p, POOL_CONCURRENT);
+  assert (pool_get_flags (new_subpool (p)) == POOL_CONCURRENT);
+
+  for (i = 0; i < NR_THREADS; ++i)
+    {
+      args[i].pool = p;
+      args[i].id = i + 1;
+      assert (pthread_create (&threads[i], 0, concurrent_worker,
+			      &args[i]) == 0);
+    }
+  for (i = 0; i < NR_THREADS; ++i)
+    pthread_join (threads[i], 0);
+
+  delete_pool (p);
+}
+
+static void * __attribute__((noinline))
+profile_alloc (pool p, size_t n)
+{
+  return pmalloc (p, n);
+}
+
+/* Count the samples and bytes in a heap profile, checking that the
+ * totals in the header agree with them.
+ */
+static void
+read_profile (const char *filename, unsigned long *count,
+	      unsigned long *bytes)
+{
+  char line[1024];
+  unsigned long c, b, c2, b2;
+  long rate;
+  FILE *fp;
+
+  fp = fopen (filename, "r");
+  assert (fp);
+  assert (fgets (line, sizeof line, fp));
+  assert (sscanf (line, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%ld",
+		  count, bytes, &c2, &b2, &rate) == 5);
+  assert (rate == profile_rate);
+  c2 = b2 = 0;
+  while (fgets (line, sizeof line, fp) && line[0] != '\n')
+    {
+      assert (sscanf (line, "%lu: %lu [", &c, &b) == 2);
+      assert (strstr (line, "] @ 0x"));
+      c2 += c;
+      b2 += b;
+    }
+  assert (c2 == *count && b2 == *bytes);
+  assert (fgets (line, sizeof line, fp));
+  assert (strcmp (line, "MAPPED_LIBRARIES:\n") == 0);
+  fclose (fp);
+}
+
+static void
+profile_test ()
+{
+  const char *old_prefix = profile_prefix;
+  long old_rate = profile_rate;
+  char prefix[256], filename[300];
+  unsigned long count, bytes;
+  pool p, sp;
+  int i;
+
+  snprintf (prefix, sizeof prefix, "/tmp/test_pool_profile.%d",
+	    (int) getpid ());
+  profile_prefix = prefix;
+  profile_seq = 0;
+  profile_rate = 1;		/* Sample nearly every allocation. */
+  profile_countdown = 0;
+
+  p = new_pool ();
+  sp = new_subpool (p);
+  for (i = 0; i < 1000; ++i)
+    profile_alloc (sp, 100);
+  assert (sp->profile && p->profile == 0);
+  assert (sp->profile->nr_entries == 1);
+  assert (sp->profile->entry[0].depth == 3);
+  assert (sp->profile->entry[0].stack[1] == sp->creator);
+  assert (sp->profile->entry[0].stack[2] == p->creator);
+  count = sp->profile->entry[0].count;
+  assert (count > 900 && sp->profile->entry[0].bytes == count * 100);
+
+  /* Deleting the subpool moves its samples to the parent. */
+  delete_pool (sp);
+  assert (p->profile && p->profile->entry[0].count == count);
+  assert (profile_pools == p && p->profile_next == 0);
+
+  /* A dump requested by the signal happens at the next sample. */
+  profile_dump_requested = 1;
+  profile_alloc (p, 100);
+  assert (profile_dump_requested == 0);
+  snprintf (filename, sizeof filename, "%s.%d.0000.heap",
+	    prefix, (int) getpid ());
+  read_profile (filename, &count, &bytes);
+  assert (count >= 900 && bytes == count * 100);
+  unlink (filename);
+
+  assert (pool_dump_profile () == 0);
+  snprintf (filename, sizeof filename, "%s.%d.0001.heap",
+	    prefix, (int) getpid ());
+  read_profile (filename, &count, &bytes);
+  unlink (filename);
+
+  /* Deleting the pool writes out its profile. */
+  delete_pool (p);
+  assert (profile_pools == 0);
+  snprintf (filename, sizeof filename, "%s.%d.0002.heap",
+	    prefix, (int) getpid ());
+  read_profile (filename, &count, &bytes);
+  assert (count > 900 && bytes == count * 100);
+  unlink (filename);
+
+  profile_prefix = old_prefix;
+  profile_rate = old_rate;
+}
+
 static void
 test ()
 {
   simple_alloc_test ();
+  prealloc_contents_test ();
+  pfree_test ();
+  poison_test ();
+  aligned_test ();
   simple_subpool_test (0, 0);
   create_delete_test ();
   cleanup_fn_test ();
+  reset_test ();
+  stats_test ();
+  limit_test ();
+  mapped_test (POOL_MMAP);
+  mapped_test (POOL_HUGEPAGES);
+  mapped_test (POOL_HUGETLB);
+  numa_test ();
   cleanup_fd_test ();
+  unregister_cleanup_test ();
+  mark_test ();
+  profile_test ();
   cleanup_malloc_test ();
   lots_of_pmalloc_test ();
+  random_delete_test ();
+  concurrent_test ();
 }
 
 /* The tracing code. */
@@ -242,8 +1038,6 @@ test ()
 #undef realloc
 #undef free
 
-static int nr_allocations = 0;
-
 static void
 trace_init ()
 {
@@ -263,7 +1057,7 @@ trace_finish ()
 static void *
 trace_malloc (size_t n, const char *filename, int line)
 {
-  nr_allocations++;
+  __sync_fetch_and_add (&nr_allocations, 1);
   return malloc (n);
 }
 
@@ -276,6 +1070,6 @@ trace_realloc (void *p, size_t n, const char *filename, int line)
 static void
 trace_free (void *p)
 {
-  nr_allocations--;
+  __sync_fetch_and_sub (&nr_allocations, 1);
   free (p);
 }
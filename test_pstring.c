@@ -275,6 +275,9 @@ main ()
   s1 = pstrdup (pool, "one");
   s1 = pstrcat (pool, s1, ",two");
   assert (strcmp (s1, "one,two") == 0);
+  s1 = psprintf (pool, "hello %d", 42);
+  s1 = pstrcat (pool, s1, ", world");
+  assert (strcmp (s1, "hello 42, world") == 0);
 
   /* pstrncat */
   s1 = pstrdup (pool, "one");
@@ -33,6 +33,9 @@
 #include <assert.h>
 #endif
 
+#include <limits.h>
+#include <math.h>
+
 #include <pool.h>
 #include <vector.h>
 #include <pstring.h>
@@ -40,14 +43,153 @@
 /* These are the numbers we'll be inserting into the array. */
 static int numbers1to9[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
 
+struct point { short x, y; };
+VECTOR_DEFINE_TYPED (point, struct point)
+#define point_less(a,b) ((a).x < (b).x)
+VECTOR_DEFINE_SORT (point, struct point, point_less)
+#define int_less(a,b) ((a) < (b))
+VECTOR_DEFINE_SORT (myint, int, int_less)
+
+static int
+cmp_int (const int *a, const int *b)
+{
+  return *a < *b ? -1 : *a > *b;
+}
+
+static int
+cmp_long (const long *a, const long *b)
+{
+  return *a < *b ? -1 : *a > *b;
+}
+
+static int
+cmp_double (const double *a, const double *b)
+{
+  return *a < *b ? -1 : *a > *b;
+}
+
+static int
+cmp_point_x (const struct point *a, const struct point *b)
+{
+  return a->x - b->x;
+}
+
+static int
+cmp_str (const char **a, const char **b)
+{
+  return strcmp (*a, *b);
+}
+
+/* A sorted vector of points used as a map from x to y. */
+static int
+cmp_x_point (const short *x, const struct point *b)
+{
+  return *x - b->x;
+}
+
+static char *
+vtostr (pool pool, vector v)
+{
+  return pjoin (pool, pvitostr (pool, v), ",");
+}
+
+/* Check the typed sorts against vector_sort on n random elements. */
+static void
+sort_test (pool pool, int n)
+{
+  vector ints = new_vector (pool, int), ints2;
+  vector longs = new_vector (pool, long), longs2;
+  vector doubles = new_vector (pool, double), doubles2;
+  vector floats = new_vector (pool, float);
+  vector points = new_vector (pool, struct point), points2;
+  vector strs = new_vector (pool, char *), strs2;
+  struct point pt;
+  int i;
+
+  for (i = 0; i < n; ++i)
+    {
+      int r = rand () - RAND_MAX / 2;
+      long l = (long) r * rand ();
+      double d = (double) r / 3;
+      float f = d;
+      char *s = pitoa (pool, r);
+
+      if (i % 10 == 0) r = i % 20 ? INT_MIN : INT_MAX;
+      vector_push_back (ints, r);
+      vector_push_back (longs, l);
+      vector_push_back (doubles, d);
+      vector_push_back (floats, f);
+      pt.x = r % 100;
+      pt.y = i;
+      vector_push_back (points, pt);
+      vector_push_back (strs, s);
+    }
+
+  ints2 = copy_vector (pool, ints);
+  vector_sort (ints, cmp_int);
+  vector_int_sort (ints2);
+  assert (vector_compare (ints, ints2, cmp_int) == 0);
+
+  longs2 = copy_vector (pool, longs);
+  vector_sort (longs, cmp_long);
+  vector_long_sort (longs2);
+  assert (vector_compare (longs, longs2, cmp_long) == 0);
+
+  doubles2 = copy_vector (pool, doubles);
+  vector_sort (doubles, cmp_double);
+  vector_double_sort (doubles2);
+  assert (vector_compare (doubles, doubles2, cmp_double) == 0);
+
+  vector_float_sort (floats);
+  for (i = 1; i < n; ++i)
+    assert (vector_float_get (floats, i-1) <= vector_float_get (floats, i));
+
+  strs2 = copy_vector (pool, strs);
+  vector_sort (strs, cmp_str);
+  vector_str_sort (strs2);
+  assert (vector_compare (strs, strs2, cmp_str) == 0);
+
+  /* The stable sort keeps equal x values in order of y. */
+  points2 = copy_vector (pool, points);
+  vector_stable_sort (points, cmp_point_x);
+  vector_point_sort (points2);
+  for (i = 1; i < n; ++i)
+    {
+      struct point a = vector_point_get (points, i-1);
+      struct point b = vector_point_get (points, i);
+
+      assert (a.x < b.x || (a.x == b.x && a.y < b.y));
+      assert (vector_point_get (points2, i-1).x <=
+	      vector_point_get (points2, i).x);
+      assert (vector_point_get (points2, i).x == b.x);
+    }
+}
+
 static void sqr_ptr (int *a, int *r) { *r = *a * *a; }
 static int gt20_ptr (int *a) { return *a > 20; }
+static int odd_ptr (int *a) { return *a & 1; }
+static int mod3_pool (pool p, int *a) { pmalloc (p, 8); return *a % 3 == 0; }
+static void str_pool (pool p, int *a, char **r) { *r = pitoa (p, *a); }
+
+/* Runs a parallel grep from inside a parallel map. */
+static pool nested_pool;
+static vector nested_v;
+static void
+nested_grep (int *a, int *r)
+{
+  *r = *a ? vector_size (vector_grep_parallel (nested_pool, nested_v,
+					       (int (*) (const void *))
+					       odd_ptr)) : -1;
+}
 
 int
 main ()
 {
   pool pool = new_pool ();
-  vector numbers, squares, squaresgt20;
+  vector numbers, squares, squaresgt20, aligned, big;
+  int i, n, reallocs;
+  void *data;
+  struct pool_stats s1, s2;
 
   /* Create initial vector. */
   numbers = new_vector (pool, int);
@@ -73,6 +215,469 @@ main ()
   printf ("squares > 20 = [ %s ]\n",
 	  pjoin (pool, pvitostr (pool, squaresgt20), ", "));
 
+  /* Aligned vectors stay aligned as they grow. */
+  aligned = new_vector_aligned (pool, double, 64);
+  for (i = 0; i < 1000; ++i)
+    {
+      double d = i;
+
+      vector_push_back (aligned, d);
+      assert (((unsigned long) aligned->data & 63) == 0);
+    }
+  /* ... and after they shrink, wherever the pool is up to. */
+  for (n = 0; n < 4; ++n)
+    {
+      pmalloc (pool, 16 * n + 1);
+      vector_erase_range (aligned, 3, vector_size (aligned));
+      vector_shrink_to_fit (aligned);
+      assert (vector_allocated (aligned) == 3);
+      assert (((unsigned long) aligned->data & 63) == 0);
+      for (i = 0; i < 100; ++i)
+	{
+	  double d = i;
+
+	  vector_push_back (aligned, d);
+	  assert (((unsigned long) aligned->data & 63) == 0);
+	}
+    }
+
+  /* Building a large vector reallocates O(log n) times. */
+  big = new_vector (pool, int);
+  reallocs = 0;
+  for (i = 0; i < 1000000; ++i)
+    {
+      int *d = big->data;
+
+      vector_push_back (big, i);
+      if (big->data != d) reallocs++;
+    }
+  assert (vector_size (big) == 1000000);
+  assert (vector_allocated (big) < 2 * 1000000);
+  assert (reallocs < 40);
+  for (i = 0; i < 1000000; i += 9999)
+    {
+      int j;
+
+      vector_get (big, i, j);
+      assert (j == i);
+    }
+
+  /* Reserved space is used by insert, fill and push_back_vector. */
+  big = new_vector (pool, int);
+  vector_reserve (big, 30);
+  assert (vector_allocated (big) == 30);
+  data = big->data;
+  vector_insert_array (big, 0, numbers1to9, 9);
+  i = 7;
+  vector_fill (big, i, 10);
+  vector_push_back_vector (big, numbers);
+  assert (vector_size (big) == 28 && big->data == data);
+  assert (vector_allocated (big) == 30);
+
+  vector_shrink_to_fit (big);
+  assert (vector_allocated (big) == 28);
+  vector_get (big, 19, i);
+  assert (i == 1);
+  vector_clear (big);
+  vector_shrink_to_fit (big);
+  assert (vector_allocated (big) == 1);
+
+  /* Shrinking gives memory back to the pool. */
+  big = new_vector (pool, int);
+  vector_reserve (big, 1000);
+  vector_insert_array (big, 0, numbers1to9, 9);
+  pool_get_stats (pool, &s1, sizeof s1);
+  vector_shrink_to_fit (big);
+  pool_get_stats (pool, &s2, sizeof s2);
+  assert (vector_allocated (big) == 9);
+  assert (s2.bytes_in_use + 900 * sizeof (int) < s1.bytes_in_use);
+  vector_get (big, 8, i);
+  assert (i == 9);
+
+  /* Insert and erase blocks at the front, middle and end. */
+  big = new_vector (pool, int);
+  vector_insert_array (big, 0, numbers1to9, 9);
+  vector_insert_array (big, 0, numbers1to9, 3);
+  vector_insert_array (big, 5, numbers1to9 + 6, 3);
+  vector_insert_array (big, vector_size (big), numbers1to9, 2);
+  vector_insert_array (big, 1, numbers1to9, 0);
+  assert (strcmp (pjoin (pool, pvitostr (pool, big), ","),
+		  "1,2,3,1,2,7,8,9,3,4,5,6,7,8,9,1,2") == 0);
+  vector_erase_range (big, 0, 3);
+  vector_erase_range (big, 2, 5);
+  vector_erase_range (big, 9, 11);
+  vector_erase (big, 4);
+  vector_erase_range (big, 4, 4);
+  assert (strcmp (pjoin (pool, pvitostr (pool, big), ","),
+		  "1,2,3,4,6,7,8,9") == 0);
+  i = 0;
+  vector_push_front (big, i);
+  vector_pop_front (big, i);
+  assert (i == 0);
+  vector_pop_front (big, i);
+  assert (i == 1 && vector_size (big) == 7);
+
+  /* A vector used as a queue keeps its size, and as a deque has
+   * constant time operations at the front.
+   */
+  big = new_vector (pool, int);
+  for (i = 0; i < 1000; ++i)
+    vector_push_back (big, i);
+  for (i = 1000; i < 1000000; ++i)
+    {
+      int j;
+
+      vector_pop_front (big, j);
+      assert (j == i - 1000);
+      vector_push_back (big, i);
+    }
+  assert (vector_size (big) == 1000 && vector_allocated (big) < 4000);
+  for (i = 0; i < 1000; ++i)
+    {
+      int j;
+
+      vector_get (big, i, j);
+      assert (j == 999000 + i);
+    }
+  for (i = 0; i < 100000; ++i)
+    vector_push_front (big, i);
+  assert (vector_size (big) == 101000);
+  vector_get (big, 0, i);
+  assert (i == 99999);
+  vector_get (big, 100000, i);
+  assert (i == 999000);
+  vector_insert_array (big, 1, numbers1to9, 9);
+  vector_erase_range (big, 1, 5);
+  vector_get (big, 1, i);
+  assert (i == 5);
+  vector_shrink_to_fit (big);
+  assert (vector_allocated (big) == 101005);
+  vector_get (big, 101004, i);
+  assert (i == 999999);
+
+  /* Typed accessors, mixed with the generic functions. */
+  big = new_vector (pool, int);
+  for (i = 0; i < 100000; ++i)
+    vector_int_push_back (big, i);
+  vector_push_back (big, i);
+  assert (vector_size (big) == 100001);
+  for (i = 0; i < 100000; i += 7)
+    {
+      int j;
+
+      vector_get (big, i, j);
+      assert (j == i && vector_int_get (big, i) == i);
+      vector_int_set (big, i, -i);
+      assert (vector_int_data (big)[i] == -i);
+    }
+  assert (vector_int_pop_back (big) == 100000);
+  vector_pop_back (big, i);
+  assert (i == 99999 && vector_int_pop_back (big) == 99998);
+  vector_pop_front (big, i);
+  assert (vector_int_get (big, 0) == 1);
+
+  {
+    vector points = new_vector (pool, struct point);
+    vector ptrs = new_vector (pool, void *);
+    struct point pt = { 3, 4 };
+
+    vector_point_push_back (points, pt);
+    pt.x = 5;
+    vector_push_back (points, pt);
+    assert (vector_point_get (points, 0).x == 3);
+    assert (vector_point_pop_back (points).x == 5);
+
+    vector_ptr_push_back (ptrs, points);
+    assert (vector_ptr_get (ptrs, 0) == points);
+  }
+
+  /* Parallel map and grep give the same results as the sequential
+   * versions.
+   */
+  big = new_vector (pool, int);
+  for (i = 0; i < 1000000; ++i)
+    vector_int_push_back (big, rand () % 46000);
+  for (n = 1; n <= 4; n *= 2)
+    {
+      struct pool *cp = new_subpool (pool);
+      vector a, b;
+      int zero = 0;
+
+      assert (vector_set_threads (n) == (n == 1 ? 0 : n / 2));
+      pool_set_flags (cp, POOL_CONCURRENT);
+
+      a = vector_map (cp, big, (void (*) (const void *, void *)) sqr_ptr,
+		      int);
+      b = vector_map_parallel (cp, big,
+			       (void (*) (const void *, void *)) sqr_ptr,
+			       int);
+      assert (vector_compare (a, b, cmp_int) == 0);
+
+      a = vector_grep (cp, big, (int (*) (const void *)) odd_ptr);
+      b = vector_grep_parallel (cp, big, (int (*) (const void *)) odd_ptr);
+      assert (vector_size (a) > 400000);
+      assert (vector_compare (a, b, cmp_int) == 0);
+
+      a = vector_grep_pool (cp, big,
+			    (int (*) (struct pool *, const void *)) mod3_pool);
+      b = vector_grep_pool_parallel (cp, big,
+				     (int (*) (struct pool *, const void *))
+				     mod3_pool);
+      assert (vector_compare (a, b, cmp_int) == 0);
+
+      a = vector_map_pool_parallel (cp, new_subvector (cp, big, 0, 50000),
+				    (void (*) (struct pool *, const void *,
+					       void *)) str_pool, char *);
+      for (i = 0; i < 50000; i += 999)
+	assert (atoi (vector_ptr_get (a, i)) == vector_int_get (big, i));
+
+      b = vector_grep_parallel (cp, new_vector (cp, int),
+				(int (*) (const void *)) odd_ptr);
+      assert (vector_size (b) == 0);
+
+      /* The worker threads are reused by later calls. */
+      a = new_subvector (cp, big, 0, 4 * 16384);
+      for (i = 0; i < 200; ++i)
+	{
+	  b = vector_grep_parallel (cp, a, (int (*) (const void *)) odd_ptr);
+	  assert (vector_size (b) > 4 * 16384 / 3);
+	}
+
+      /* A parallel call made while the threads are busy runs in the
+       * calling thread.
+       */
+      nested_pool = cp;
+      nested_v = new_subvector (cp, big, 0, 2 * 16384);
+      b = vector_grep (cp, nested_v, (int (*) (const void *)) odd_ptr);
+      a = new_vector (cp, int);
+      vector_fill (a, zero, 4 * 16384);
+      for (i = 0; i < 4; ++i)
+	vector_int_set (a, i * 16384, 1);
+      a = vector_map_parallel (cp, a,
+			       (void (*) (const void *, void *)) nested_grep,
+			       int);
+      for (i = 0; i < 4 * 16384; ++i)
+	assert (vector_int_get (a, i) ==
+		(i % 16384 == 0 ? vector_size (b) : -1));
+
+      delete_pool (cp);
+    }
+  vector_set_threads (0);
+
+  /* Sorted vectors. */
+  {
+    int a1[] = { 1, 3, 3, 5, 7, 7, 7, 9 }, a2[] = { 2, 3, 7, 7, 10 };
+    int a3[] = { 0, 3, 11 };
+    vector v1 = new_vector (pool, int), v2 = new_vector (pool, int);
+    vector v3 = new_vector (pool, int), vs[4];
+    struct point pt;
+    short x;
+
+    vector_insert_array (v1, 0, a1, 8);
+    vector_insert_array (v2, 0, a2, 5);
+    vector_insert_array (v3, 0, a3, 3);
+
+    i = 7;
+    assert (vector_lower_bound (v1, i, cmp_int) == 4);
+    assert (vector_upper_bound (v1, i, cmp_int) == 7);
+    assert (vector_bsearch (v1, i, cmp_int) >= 4 &&
+	    vector_bsearch (v1, i, cmp_int) < 7);
+    i = 4;
+    assert (vector_bsearch (v1, i, cmp_int) == -1);
+    assert (vector_lower_bound (v1, i, cmp_int) == 3);
+    i = 0;
+    assert (vector_lower_bound (v1, i, cmp_int) == 0);
+    i = 10;
+    assert (vector_upper_bound (v1, i, cmp_int) == 8);
+    assert (vector_bsearch (new_vector (pool, int), i, cmp_int) == -1);
+
+    assert (strcmp (vtostr (pool, vector_union (pool, v1, v2, cmp_int)),
+		    "1,2,3,3,5,7,7,7,9,10") == 0);
+    assert (strcmp (vtostr (pool, vector_intersection (pool, v1, v2,
+						       cmp_int)),
+		    "3,7,7") == 0);
+    assert (vector_size (vector_union (pool, new_vector (pool, int),
+				       new_vector (pool, int), cmp_int)) == 0);
+
+    vs[0] = v1; vs[1] = new_vector (pool, int); vs[2] = v2; vs[3] = v3;
+    assert (strcmp (vtostr (pool, vector_merge (pool, vs, 4, cmp_int)),
+		    "0,1,2,3,3,3,3,5,7,7,7,7,7,9,10,11") == 0);
+
+    i = 6;
+    assert (vector_insert_sorted (v1, i, cmp_int) == 4);
+    i = 7;
+    assert (vector_insert_sorted (v1, i, cmp_int) == 8);
+    i = 100;
+    assert (vector_insert_sorted (v1, i, cmp_int) == 10);
+    assert (strcmp (vtostr (pool, v1), "1,3,3,5,6,7,7,7,7,9,100") == 0);
+
+    /* Flat map with a key of a different type to the elements. */
+    big = new_vector (pool, struct point);
+    for (i = 0; i < 1000; ++i)
+      {
+	pt.x = (i * 7919) % 1000;
+	pt.y = i;
+	vector_insert_sorted (big, pt, cmp_point_x);
+      }
+    for (x = 0; x < 1000; ++x)
+      {
+	i = vector_bsearch (big, x, cmp_x_point);
+	assert (vector_point_get (big, i).x == x);
+	assert ((vector_point_get (big, i).y * 7919) % 1000 == x);
+      }
+
+    /* The merge is stable. */
+    v1 = new_vector (pool, struct point);
+    v2 = new_vector (pool, struct point);
+    for (i = 0; i < 10; ++i)
+      {
+	pt.x = i / 3;
+	pt.y = i;
+	vector_push_back (v1, pt);
+	pt.y = 100 + i;
+	vector_push_back (v2, pt);
+      }
+    vs[0] = v1; vs[1] = v2;
+    big = vector_merge (pool, vs, 2, cmp_point_x);
+    for (i = 1; i < 20; ++i)
+      {
+	struct point a = vector_point_get (big, i-1);
+	struct point b = vector_point_get (big, i);
+
+	assert (a.x < b.x || (a.x == b.x && a.y < b.y));
+      }
+  }
+
+  /* Views share the data of the vector or array they are made from. */
+  {
+    vector view, strs;
+    const char *words[] = { "a", "b", "c", "d" };
+
+    big = new_vector (pool, int);
+    for (i = 0; i < 1000000; ++i)
+      vector_int_push_back (big, i);
+    view = new_subvector_view (pool, big, 1000, 1010);
+    assert (vector_is_view (view) && !vector_is_view (big));
+    assert (vector_size (view) == 10 && vector_int_get (view, 0) == 1000);
+    assert (_vector_get_ptr (view, 0) == _vector_get_ptr (big, 1000));
+    vector_int_set (big, 1000, -1);
+    assert (vector_int_get (view, 0) == -1);
+    assert (vector_compare (view, new_subvector (pool, big, 1000, 1010),
+			    cmp_int) == 0);
+    assert (vector_size (vector_grep (pool, view, (int (*) (const void *))
+				      odd_ptr)) == 6);
+    assert (vector_int_get (vector_map (pool, view,
+					(void (*) (const void *, void *))
+					sqr_ptr, int), 1) == 1001 * 1001);
+    i = 1005;
+    assert (vector_bsearch (view, i, cmp_int) == 5);
+
+    /* Sort a copy. */
+    view = copy_vector (pool, new_subvector_view (pool, big, 999, 1001));
+    assert (!vector_is_view (view));
+    vector_int_sort (view);
+    assert (vector_int_get (view, 0) == -1);
+
+    view = new_subvector_view (pool, big, 10, 10);
+    assert (vector_size (view) == 0);
+
+    strs = new_vector_view (pool, char *, words, 4);
+    assert (strcmp (pjoin (pool, strs, "-"), "a-b-c-d") == 0);
+    view = new_vector (pool, char *);
+    vector_push_back_vector (view, strs);
+    vector_push_back_vector (view, new_subvector_view (pool, strs, 1, 3));
+    assert (strcmp (pjoin (pool, view, ""), "abcdbc") == 0);
+  }
+
+  /* Vectors with inline storage. */
+  {
+    vector iv = new_vector_inline (pool, double, 3);
+    double d = 1.5;
+
+    assert (vector_allocated (iv) == 3 && vector_size (iv) == 0);
+    assert ((char *) iv->data - (char *) iv < 64);
+    assert (((unsigned long) iv->data & 15) == 0);
+    vector_double_push_back (iv, d);
+    vector_push_back (iv, d);
+    vector_push_front (iv, d);
+    vector_pop_front (iv, d);
+    vector_shrink_to_fit (iv);
+    vector_double_push_back (iv, 2.5);
+    assert ((char *) iv->data - (char *) iv < 64);
+    assert (vector_size (iv) == 3 && vector_double_get (iv, 2) == 2.5);
+
+    /* Outgrowing the inline storage moves the elements to the pool. */
+    vector_double_push_back (iv, 3.5);
+    assert (vector_size (iv) == 4 && vector_allocated (iv) > 4);
+    assert (vector_double_get (iv, 0) == 1.5 &&
+	    vector_double_get (iv, 2) == 2.5 &&
+	    vector_double_get (iv, 3) == 3.5);
+    for (i = 0; i < 1000; ++i)
+      vector_push_front (iv, d);
+    assert (vector_size (iv) == 1004 && vector_double_get (iv, 1003) == 3.5);
+
+    iv = new_vector_inline (pool, int, 2);
+    vector_push_front (iv, i);
+    vector_insert_array (iv, 0, numbers1to9, 9);
+    assert (strcmp (vtostr (pool, iv), "1,2,3,4,5,6,7,8,9,1000") == 0);
+  }
+
+  /* Sorting. */
+  sort_test (pool, 0);
+  sort_test (pool, 1);
+  sort_test (pool, 100);
+  sort_test (pool, 10000);
+  {
+    double special[] = { 1, -0.0, 0.0, -1, 1.0/0.0, -1.0/0.0, 0.5, -0.5 };
+    double expected[] = { -1.0/0.0, -1, -0.5, -0.0, 0.0, 0.5, 1, 1.0/0.0 };
+    double d;
+
+    /* Few elements (insertion sort) and many (radix sort). */
+    for (n = 8; n <= 800; n *= 100)
+      {
+	big = new_vector (pool, double);
+	for (i = 0; i < n; ++i)
+	  vector_push_back (big, special[i % 8]);
+	d = NAN;
+	vector_push_back (big, d);
+	vector_double_sort (big);
+	for (i = 0; i < n; ++i)
+	  {
+	    d = vector_double_get (big, i);
+	    assert (d == expected[i * 8 / n] &&
+		    signbit (d) == signbit (expected[i * 8 / n]));
+	  }
+	d = vector_double_get (big, n);
+	assert (d != d);
+      }
+  }
+
+  /* Sorted, reversed and constant inputs to the introsort. */
+  big = new_vector (pool, int);
+  for (i = 0; i < 10000; ++i)
+    vector_int_push_back (big, i);
+  vector_myint_sort (big);
+  for (i = 0; i < 10000; ++i)
+    assert (vector_int_get (big, i) == i);
+  for (i = 0; i < 10000; ++i)
+    vector_int_set (big, i, 9999 - i);
+  vector_myint_sort (big);
+  for (i = 0; i < 10000; ++i)
+    assert (vector_int_get (big, i) == i);
+  vector_clear (big);
+  i = 1;
+  vector_fill (big, i, 10000);
+  vector_myint_sort (big);
+  assert (vector_int_get (big, 0) == 1 && vector_int_get (big, 9999) == 1);
+
+  /* A smaller growth factor. */
+  assert (vector_set_growth (150) == 200);
+  big = new_vector (pool, int);
+  vector_fill (big, i, 100);
+  vector_push_back (big, i);
+  assert (vector_allocated (big) == 150);
+  vector_set_growth (200);
+
   delete_pool (pool);
   exit (0);
 }
@@ -5,6 +5,12 @@
 # over a trace file for a program which is currently running, this will
 # show currently allocated space.
 #
+# Both the text trace format and the binary format written when
+# POOL_TRACE_FORMAT=binary are understood. A binary trace must be read
+# on a machine with the same byte order as the one which wrote it.
+# Operations on a concurrent pool which race in different threads may
+# be traced in the wrong order.
+#
 # By Richard W.M. Jones <rich@annexia.org>
 #
 # $Id: curallocs.pl,v 1.1 2001/02/08 12:51:35 rich Exp $
@@ -15,105 +21,216 @@ my %pools = ();
 
 my $lineno = 0;
 
-while (<>)
+# Records are numbered as they are processed, so that
+# pool_release_to_mark can tell which allocations came after the mark.
+my $serial = 0;
+
+# Read the whole trace. Binary traces (POOL_TRACE_FORMAT=binary) start
+# with the magic string "POOLTRC1"; anything else is read as text.
+my $data;
+{
+  local $/;
+  $data = <>;
+  $data = "" unless defined $data;
+}
+
+if (substr ($data, 0, 8) eq "POOLTRC1")
   {
-    $lineno++;
+    my @fns = qw(new_pool new_subpool delete_pool pool_reset pmalloc
+		 pcalloc pmalloc_aligned prealloc pfree pool_mark
+		 pool_release_to_mark);
+    my ($record_size) = unpack "L", substr ($data, 8, 4);
+    my @records = ();
+
+    for (my $offset = 16;
+	 $offset + $record_size <= length $data;
+	 $offset += $record_size)
+      {
+	my ($time, $caller, $ptr1, $ptr2, $ptr3, $i1, $fn, $thread) =
+	  unpack "Q Q Q Q Q q L L", substr ($data, $offset, $record_size);
 
-    s/[\n\r]+$//;
+	die "unknown function number $fn in binary trace"
+	  unless $fn < @fns;
 
-    if (/^([a-z_]+)\s+caller:\s+([0-9a-fx]+)\s+ptr1:\s+([0-9a-fx]+|\(nil\))\s+ptr2:\s+([0-9a-fx]+|\(nil\))\s+ptr3:\s+([0-9a-fx]+|\(nil\))\s+i1:\s+([0-9]+)\s*$/)
+	push @records, [ $time, $fns[$fn], sprintf ("0x%x", $caller),
+			 $ptr1 ? sprintf ("0x%x", $ptr1) : 0,
+			 $ptr2 ? sprintf ("0x%x", $ptr2) : 0,
+			 $ptr3 ? sprintf ("0x%x", $ptr3) : 0,
+			 $i1 ];
+      }
+
+    # Each thread writes its own buffer, so put the records back into
+    # time order first.
+    foreach (sort { $a->[0] <=> $b->[0] } @records)
       {
-	my $fn = $1;
-	my $caller = $2;
-	my $ptr1 = $3 ne '(nil)' ? $3 : 0;
-	my $ptr2 = $4 ne '(nil)' ? $4 : 0;
-	my $ptr3 = $5 ne '(nil)' ? $4 : 0;
-	my $i1 = $6;
+	$lineno++;
+	process_record (@$_[1..6]);
+      }
+  }
+else
+  {
+    foreach (split /\n/, $data)
+      {
+	$lineno++;
 
-	if ($fn eq "new_pool")
+	s/[\n\r]+$//;
+
+	if (/^([a-z_]+)\s+caller:\s+([0-9a-fx]+)\s+ptr1:\s+([0-9a-fx]+|\(nil\))\s+ptr2:\s+([0-9a-fx]+|\(nil\))\s+ptr3:\s+([0-9a-fx]+|\(nil\))\s+i1:\s+(-?[0-9]+)\s*$/)
 	  {
-	    die "new_pool: pool exists, line $lineno"
-	      if exists $pools{$ptr1};
-
-	    $pools{$ptr1} = {
-			     creator => $caller,
-			     pool => $ptr1,
-			     children => {},
-			     allocations => {}
-			    };
+	    process_record ($1, $2,
+			    $3 ne '(nil)' ? $3 : 0,
+			    $4 ne '(nil)' ? $4 : 0,
+			    $5 ne '(nil)' ? $5 : 0,
+			    $6);
 	  }
-	elsif ($fn eq "new_subpool")
+	else
 	  {
-	    die "new_subpool: pool exists, line $lineno"
-	      if exists $pools{$ptr1};
-
-	    $pools{$ptr1} = {
-			     creator => $caller,
-			     pool => $ptr1,
-			     parent => $ptr2,
-			     children => {},
-			     allocations => {}
-			    };
-	    $pools{$ptr2}{children}{$ptr1} = 1;
+	    print "$lineno: $_\n";
+	    die "cannot parse line";
 	  }
-	elsif ($fn eq "delete_pool")
-	  {
-	    if ($pools{$ptr1}{parent})
-	      {
-		delete $pools{$pools{$ptr1}{parent}}{children}{$ptr1};
-	      }
+      }
+  }
 
-	    remove_pool_recursively ($ptr1);
+if (keys %pools > 0) {
+  show_pools ();
+} else {
+  print "No pools are currently allocated.\n";
+}
+
+exit 0;
+
+sub process_record
+  {
+    my ($fn, $caller, $ptr1, $ptr2, $ptr3, $i1) = @_;
+
+    $serial++;
+
+    if ($fn eq "new_pool")
+      {
+	die "new_pool: pool exists, line $lineno"
+	  if exists $pools{$ptr1};
+
+	$pools{$ptr1} = {
+			 creator => $caller,
+			 pool => $ptr1,
+			 children => {},
+			 allocations => {},
+			 marks => {}
+			};
+      }
+    elsif ($fn eq "new_subpool")
+      {
+	# new_pool has already traced this pool, unless the subpool
+	# was recycled from an earlier delete_pool.
+	die "new_subpool: pool exists, line $lineno"
+	  if exists $pools{$ptr1} && $pools{$ptr1}{parent};
+
+	$pools{$ptr1} = {
+			 creator => $caller,
+			 pool => $ptr1,
+			 parent => $ptr2,
+			 children => {},
+			 allocations => {},
+			 marks => {}
+			};
+	$pools{$ptr2}{children}{$ptr1} = 1;
+      }
+    elsif ($fn eq "delete_pool")
+      {
+	if ($pools{$ptr1}{parent})
+	  {
+	    delete $pools{$pools{$ptr1}{parent}}{children}{$ptr1};
 	  }
-	elsif ($fn eq "pmalloc")
+
+	remove_pool_recursively ($ptr1);
+      }
+    elsif ($fn eq "pmalloc" || $fn eq "pcalloc" ||
+	   $fn eq "pmalloc_aligned")
+      {
+	die "$fn: no pool $ptr1, line $lineno"
+	  unless exists $pools{$ptr1};
+
+	$pools{$ptr1}{allocations}{$ptr2} = {
+					     creator => $caller,
+					     pool => $ptr1,
+					     address => $ptr2,
+					     size => $i1,
+					     serial => $serial
+					    };
+      }
+    elsif ($fn eq "prealloc")
+      {
+	die "prealloc: no pool $ptr1, line $lineno"
+	  unless exists $pools{$ptr1};
+	die "prealloc: allocation already exists, line $lineno"
+	  unless exists $pools{$ptr1}{allocations}{$ptr2};
+
+	# Delete the old allocation.
+	delete $pools{$ptr1}{allocations}{$ptr2};
+
+	$pools{$ptr1}{allocations}{$ptr3} = {
+					     creator => $caller,
+					     pool => $ptr1,
+					     address => $ptr3,
+					     size => $i1,
+					     serial => $serial
+					    };
+      }
+    elsif ($fn eq "pfree")
+      {
+	die "pfree: no pool $ptr1, line $lineno"
+	  unless exists $pools{$ptr1};
+
+	delete $pools{$ptr1}{allocations}{$ptr2};
+      }
+    elsif ($fn eq "pool_reset")
+      {
+	die "pool_reset: no pool $ptr1, line $lineno"
+	  unless exists $pools{$ptr1};
+
+	foreach (keys %{$pools{$ptr1}{children}})
 	  {
-	    die "pmalloc: no pool $ptr1, line $lineno"
-	      unless exists $pools{$ptr1};
-
-	    $pools{$ptr1}{allocations}{$ptr2} = {
-						 creator => $caller,
-						 pool => $ptr1,
-						 address => $ptr2,
-						 size => $i1
-						};
+	    remove_pool_recursively ($_);
 	  }
-	elsif ($fn eq "prealloc")
+	$pools{$ptr1}{children} = {};
+	$pools{$ptr1}{allocations} = {};
+	$pools{$ptr1}{marks} = {};
+      }
+    elsif ($fn eq "pool_mark")
+      {
+	die "pool_mark: no pool $ptr1, line $lineno"
+	  unless exists $pools{$ptr1};
+
+	$pools{$ptr1}{marks}{$ptr2} = $serial;
+      }
+    elsif ($fn eq "pool_release_to_mark")
+      {
+	die "pool_release_to_mark: no pool $ptr1, line $lineno"
+	  unless exists $pools{$ptr1};
+	die "pool_release_to_mark: no mark $ptr2, line $lineno"
+	  unless exists $pools{$ptr1}{marks}{$ptr2};
+
+	# Subpools created since the mark have already been deleted.
+	# Drop the allocations made since the mark, and any later marks.
+	my $mark = $pools{$ptr1}{marks}{$ptr2};
+	my $allocations = $pools{$ptr1}{allocations};
+	my $marks = $pools{$ptr1}{marks};
+
+	foreach (keys %$allocations)
 	  {
-	    die "prealloc: no pool $ptr1, line $lineno"
-	      unless exists $pools{$ptr1};
-	    die "prealloc: allocation already exists, line $lineno"
-	      unless exists $pools{$ptr1}{allocations}{$ptr2};
-
-	    # Delete the old allocation.
-	    delete $pools{$ptr1}{allocations}{$ptr2};
-
-	    $pools{$ptr1}{allocations}{$ptr3} = {
-						 creator => $caller,
-						 pool => $ptr1,
-						 address => $ptr3,
-						 size => $i1
-						};
+	    delete $allocations->{$_} if $allocations->{$_}{serial} > $mark;
 	  }
-	else
+	foreach (keys %$marks)
 	  {
-	    die "unknown pool function traced: $fn, line $lineno";
+	    delete $marks->{$_} if $marks->{$_} > $mark;
 	  }
       }
     else
       {
-	print "$lineno: $_\n";
-	die "cannot parse line";
+	die "unknown pool function traced: $fn, line $lineno";
       }
   }
 
-if (keys %pools > 0) {
-  show_pools ();
-} else {
-  print "No pools are currently allocated.\n";
-}
-
-exit 0;
-
 sub remove_pool_recursively
   {
     my $pool = shift;
@@ -32,12 +32,20 @@
 
 #include "tree.h"
 
+/* Room for this many subnodes is allocated with each node, after the
+ * node's data.
+ */
+#define TREE_INLINE 4
+
 tree
 _tree_new (pool pool, size_t size)
 {
-  tree t = (tree) new_vector (pool, tree);
+  size_t offset = (sizeof (struct tree) + size + sizeof (tree) - 1)
+    & ~(sizeof (tree) - 1);
+  tree t = pmalloc (pool, offset + TREE_INLINE * sizeof (tree));
 
-  t = prealloc (pool, t, sizeof (*t) + size);
+  _vector_init_inline (&t->v, pool, sizeof (tree),
+		       (char *) t + offset, TREE_INLINE);
   t->size = size;
 
   return t;
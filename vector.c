@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifdef HAVE_STRING_H
 #include <string.h>
@@ -31,12 +32,142 @@
 #include <assert.h>
 #endif
 
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <pthread.h>
+
 #include <pstring.h>
 #include <pool.h>
 #include <vector.h>
 
 #define INCREMENT 16
 
+/* When a vector is full, its allocation is multiplied by growth/100,
+ * so pushing n elements costs O(log n) calls to prealloc.
+ */
+static int growth = 200;
+
+int
+vector_set_growth (int percent)
+{
+  int old = growth;
+
+  assert (percent > 100);
+  growth = percent;
+  return old;
+}
+
+/* The data starts v->start elements into the block allocated for
+ * it, leaving room to push elements on the front. v->allocated counts
+ * only the elements from v->data onwards.
+ */
+#define _vector_base(v) ((v)->data - (v)->start * (v)->size)
+
+/* Resize the block holding the data to n bytes, and return the new
+ * block. A vector using inline storage moves to the pool instead.
+ */
+static inline void *
+_vector_realloc (vector v, size_t n)
+{
+  void *d;
+  size_t old_n;
+
+  if (!(v->flags & VECTOR_INLINE))
+    return prealloc (v->pool, v->data ? _vector_base (v) : 0, n);
+
+  old_n = (v->start + v->allocated) * v->size;
+  d = pmalloc (v->pool, n);
+  memcpy (d, _vector_base (v), n < old_n ? n : old_n);
+  v->flags &= ~VECTOR_INLINE;
+  return d;
+}
+
+/* Move the elements back to the start of the block. */
+static inline void
+_vector_compact (vector v)
+{
+  if (v->start > 0)
+    {
+      memmove (_vector_base (v), v->data, v->used * v->size);
+      v->data = _vector_base (v);
+      v->allocated += v->start;
+      v->start = 0;
+    }
+}
+
+/* Make room for at least n elements, growing the allocation
+ * geometrically so that repeated calls are amortized O(1).
+ */
+static inline void
+_vector_grow (vector v, int n)
+{
+  long a;
+  void *d;
+
+  assert (!vector_is_view (v));
+  if (n <= v->allocated)
+    return;
+
+  /* If a vector used as a queue has at least as much free space at
+   * the front as it has elements, reuse the space.
+   */
+  if (v->start > 0 && v->start >= v->used)
+    {
+      _vector_compact (v);
+      if (n <= v->allocated)
+	return;
+    }
+
+  a = (long) v->allocated * growth / 100;
+  if (a < v->allocated + INCREMENT) a = v->allocated + INCREMENT;
+  if (a < n) a = n;
+  if (a > INT_MAX - v->start) a = INT_MAX - v->start;
+
+  d = _vector_realloc (v, (v->start + a) * v->size);
+  v->allocated = a;
+  v->data = d + v->start * v->size;
+}
+
+/* Make room for at least n elements in front of the data. */
+static inline void
+_vector_grow_front (vector v, int n)
+{
+  long h;
+  void *d;
+
+  assert (!vector_is_view (v));
+  if (n <= v->start)
+    return;
+
+  /* Small inline vectors make room by moving within their storage. */
+  if ((v->flags & VECTOR_INLINE) && v->used + n <= v->start + v->allocated)
+    {
+      h = v->start + v->allocated - v->used;
+      d = _vector_base (v);
+      memmove (d + h * v->size, v->data, v->used * v->size);
+      v->data = d + h * v->size;
+      v->allocated = v->used;
+      v->start = h;
+      return;
+    }
+
+  h = (long) v->used * (growth - 100) / 100;
+  if (h < INCREMENT) h = INCREMENT;
+  if (h < n) h = n;
+  if (h > INT_MAX - v->allocated) h = INT_MAX - v->allocated;
+
+  d = _vector_realloc (v, (h + v->allocated) * v->size);
+  memmove (d + h * v->size, d + v->start * v->size, v->used * v->size);
+  v->data = d + h * v->size;
+  v->start = h;
+}
+
 vector
 _vector_new (pool pool, size_t size)
 {
@@ -45,7 +176,48 @@ _vector_new (pool pool, size_t size)
   v->pool = pool;
   v->size = size;
   v->data = 0;
-  v->used = v->allocated = 0;
+  v->used = v->allocated = v->start = 0;
+  v->flags = 0;
+
+  return v;
+}
+
+void
+_vector_init_inline (vector v, pool pool, size_t size, void *storage, int n)
+{
+  v->pool = pool;
+  v->size = size;
+  v->data = storage;
+  v->used = v->start = 0;
+  v->allocated = n;
+  v->flags = VECTOR_INLINE;
+}
+
+/* The inline storage follows the structure, aligned as pmalloc
+ * would align it.
+ */
+#define INLINE_OFFSET ((sizeof (struct vector) + 15) & ~15)
+
+vector
+_vector_new_inline (pool pool, size_t size, int n)
+{
+  vector v = pmalloc (pool, INLINE_OFFSET + n * size);
+
+  _vector_init_inline (v, pool, size, (char *) v + INLINE_OFFSET, n);
+  return v;
+}
+
+/* The data is allocated up front with the right alignment, and
+ * prealloc keeps that alignment as the vector grows.
+ */
+vector
+_vector_new_aligned (pool pool, size_t size, size_t align)
+{
+  vector v = _vector_new (pool, size);
+
+  v->data = pmalloc_aligned (pool, INCREMENT * size, align);
+  v->allocated = INCREMENT;
+  v->flags = __builtin_ctzl (align) << VECTOR_ALIGN_SHIFT;
 
   return v;
 }
@@ -59,6 +231,8 @@ new_subvector (pool pool, vector v, int i, int j)
 
   new_v->pool = pool;
   new_v->size = v->size;
+  new_v->start = 0;
+  new_v->flags = 0;
 
   if (i < j)
     {
@@ -74,6 +248,30 @@ new_subvector (pool pool, vector v, int i, int j)
   return new_v;
 }
 
+vector
+_vector_new_view (pool pool, size_t size, const void *ptr, int n)
+{
+  vector v = pmalloc (pool, sizeof *v);
+
+  assert (n >= 0);
+  v->pool = pool;
+  v->size = size;
+  v->data = (void *) ptr;
+  v->used = v->allocated = n;
+  v->start = 0;
+  v->flags = VECTOR_VIEW;
+
+  return v;
+}
+
+vector
+new_subvector_view (pool pool, vector v, int i, int j)
+{
+  assert (0 <= i && i <= j && j <= v->used);
+
+  return _vector_new_view (pool, v->size, v->data + i * v->size, j - i);
+}
+
 vector
 copy_vector (pool pool, vector v)
 {
@@ -84,12 +282,7 @@ inline void
 _vector_push_back (vector v, const void *ptr)
 {
   if (v->used >= v->allocated)
-    {
-      int a = v->allocated + INCREMENT;
-      void *d = prealloc (v->pool, v->data, a * v->size);
-      v->allocated = a;
-      v->data = d;
-    }
+    _vector_grow (v, v->used + 1);
 
   if (ptr) memcpy (v->data + v->used * v->size, ptr, v->size);
   v->used++;
@@ -98,6 +291,7 @@ _vector_push_back (vector v, const void *ptr)
 void
 _vector_pop_back (vector v, void *ptr)
 {
+  assert (!vector_is_view (v));
   assert (v->used > 0);
   v->used--;
   if (ptr) memcpy (ptr, v->data + v->used * v->size, v->size);
@@ -106,16 +300,29 @@ _vector_pop_back (vector v, void *ptr)
 inline void
 vector_insert_array (vector v, int i, const void *ptr, int n)
 {
-  int j;
+  assert (!vector_is_view (v));
+  assert (0 <= i && i <= v->used && n >= 0);
 
-  assert (0 <= i && i <= v->used);
+  if (i == 0 && v->used > 0)
+    _vector_grow_front (v, n);
 
-  /* Insert n dummy elements at the end of the list. */
-  for (j = 0; j < n; ++j) _vector_push_back (v, 0);
-
-  /* Move the other elements up. */
-  for (j = v->used-1; j > i; --j)
-    memcpy (v->data + j * v->size, v->data + (j-n) * v->size, v->size);
+  /* Move the elements before i down into the free space at the front
+   * if there are fewer of them, otherwise move the other elements up.
+   */
+  if (v->start >= n && (i == 0 || i < v->used / 2))
+    {
+      v->data -= n * v->size;
+      v->start -= n;
+      v->allocated += n;
+      memmove (v->data, v->data + n * v->size, i * v->size);
+    }
+  else
+    {
+      _vector_grow (v, v->used + n);
+      memmove (v->data + (i+n) * v->size, v->data + i * v->size,
+	       (v->used - i) * v->size);
+    }
+  v->used += n;
 
   /* Insert these elements at position i. */
   if (ptr) memcpy (v->data + i * v->size, ptr, v->size * n);
@@ -147,13 +354,7 @@ vector_push_back_vector (vector v, const vector w)
 
   assert (size == w->size);
 
-  if (v->used + w->used > v->allocated)
-    {
-      int a = v->used + w->used;
-      void *d = prealloc (v->pool, v->data, a * size);
-      v->allocated = a;
-      v->data = d;
-    }
+  _vector_grow (v, v->used + w->used);
 
   memcpy (v->data + v->used * size, w->data, size * w->used);
   v->used += w->used;
@@ -162,26 +363,15 @@ vector_push_back_vector (vector v, const vector w)
 void
 vector_push_front_vector (vector v, const vector w)
 {
-  int size = v->size;
-
-  assert (size == w->size);
-
-  if (v->used + w->used > v->allocated)
-    {
-      int a = v->used + w->used;
-      void *d = prealloc (v->pool, v->data, a * size);
-      v->allocated = a;
-      v->data = d;
-    }
+  assert (v->size == w->size);
 
-  memmove (v->data + w->used * size, v->data, v->used * size);
-  memcpy (v->data, w->data, size * w->used);
-  v->used += w->used;
+  vector_insert_array (v, 0, w->data, w->used);
 }
 
 void
 _vector_replace (vector v, int i, const void *ptr)
 {
+  assert (!vector_is_view (v));
   assert (0 <= i && i < v->used);
 
   if (ptr) memcpy (v->data + i * v->size, ptr, v->size);
@@ -190,16 +380,25 @@ _vector_replace (vector v, int i, const void *ptr)
 inline void
 vector_erase_range (vector v, int i, int j)
 {
+  assert (!vector_is_view (v));
   assert (0 <= i && i < v->used && 0 <= j && j <= v->used);
 
-  if (i < j)
+  if (i < j && i < v->used - j)
     {
-      int n = j - i, k;
-
-      for (k = i+n; k < v->used; ++k)
-	memcpy (v->data + (k-n) * v->size, v->data + k * v->size, v->size);
-
-      v->used -= n;
+      /* Fewer elements before the range than after it, so move them
+       * up and leave the space at the front.
+       */
+      memmove (v->data + (j-i) * v->size, v->data, i * v->size);
+      v->data += (j-i) * v->size;
+      v->start += j-i;
+      v->allocated -= j-i;
+      v->used -= j-i;
+    }
+  else if (i < j)
+    {
+      memmove (v->data + i * v->size, v->data + j * v->size,
+	       (v->used - j) * v->size);
+      v->used -= j - i;
     }
 }
 
@@ -212,7 +411,9 @@ vector_erase (vector v, int i)
 void
 vector_clear (vector v)
 {
+  assert (!vector_is_view (v));
   v->used = 0;
+  _vector_compact (v);
 }
 
 void
@@ -232,7 +433,442 @@ _vector_get_ptr (vector v, int i)
 void
 _vector_sort (vector v, int (*compare_fn) (const void *, const void *))
 {
-  qsort (v->data, v->used, v->size, compare_fn);
+  assert (!vector_is_view (v));
+  if (v->used > 1)
+    qsort (v->data, v->used, v->size, compare_fn);
+}
+
+/* Merge sort. Runs of RUN elements are first sorted by insertion,
+ * then merged in pairs, back and forth between the vector and a
+ * temporary array.
+ */
+#define RUN 16
+
+void
+_vector_stable_sort (vector v,
+		     int (*compare_fn) (const void *, const void *))
+{
+  size_t size = v->size;
+  int n = v->used, i, j, k, lo, mid, hi, w;
+  char *src, *dst, *tmp, t[size];
+
+  assert (!vector_is_view (v));
+  if (n < 2) return;
+
+  src = v->data;
+  for (lo = 0; lo < n; lo += RUN)
+    {
+      hi = lo + RUN < n ? lo + RUN : n;
+      for (i = lo + 1; i < hi; ++i)
+	{
+	  memcpy (t, src + i * size, size);
+	  for (j = i; j > lo && compare_fn (src + (j-1) * size, t) > 0; --j)
+	    memcpy (src + j * size, src + (j-1) * size, size);
+	  memcpy (src + j * size, t, size);
+	}
+    }
+  if (n <= RUN) return;
+
+  tmp = pmalloc (v->pool, n * size);
+  dst = tmp;
+  for (w = RUN; w < n; w *= 2)
+    {
+      for (lo = 0; lo < n; lo += 2*w)
+	{
+	  mid = lo + w < n ? lo + w : n;
+	  hi = lo + 2*w < n ? lo + 2*w : n;
+	  i = lo; j = mid; k = lo;
+
+	  /* Taking from the left run on ties keeps the sort stable. */
+	  while (i < mid && j < hi)
+	    if (compare_fn (src + j * size, src + i * size) < 0)
+	      memcpy (dst + k++ * size, src + j++ * size, size);
+	    else
+	      memcpy (dst + k++ * size, src + i++ * size, size);
+	  memcpy (dst + k * size, src + i * size, (mid - i) * size);
+	  k += mid - i;
+	  memcpy (dst + k * size, src + j * size, (hi - j) * size);
+	}
+      tmp = src; src = dst; dst = tmp;
+    }
+
+  if (src != v->data)
+    {
+      memcpy (v->data, src, n * size);
+      pfree (v->pool, src);
+    }
+  else
+    pfree (v->pool, dst);
+}
+
+/* LSD radix sort of n unsigned keys, one byte at a time. The keys
+ * are first mapped so that their unsigned order is the order wanted,
+ * and mapped back at the end. Passes where every key has the same
+ * byte are skipped.
+ */
+#define RADIX_SORT(name, utype, to_key, from_key)			\
+static void								\
+name (vector v)								\
+{									\
+  const int nr_bytes = sizeof (utype);					\
+  int n = v->used, i, b;						\
+  utype *a = v->data, *tmp, *src, *dst;					\
+  int count[sizeof (utype)][256], pos;					\
+									\
+  memset (count, 0, sizeof count);					\
+  for (i = 0; i < n; ++i)						\
+    {									\
+      a[i] = to_key (a[i]);						\
+      for (b = 0; b < nr_bytes; ++b)					\
+	count[b][(a[i] >> (8*b)) & 0xff]++;				\
+    }									\
+									\
+  tmp = pmalloc (v->pool, n * sizeof (utype));				\
+  src = a; dst = tmp;							\
+  for (b = 0; b < nr_bytes; ++b)					\
+    {									\
+      utype *t;								\
+									\
+      if (count[b][(a[0] >> (8*b)) & 0xff] == n)			\
+	continue;							\
+      for (i = 0, pos = 0; i < 256; ++i)				\
+	{								\
+	  int c = count[b][i];						\
+	  count[b][i] = pos;						\
+	  pos += c;							\
+	}								\
+      for (i = 0; i < n; ++i)						\
+	dst[count[b][(src[i] >> (8*b)) & 0xff]++] = src[i];		\
+      t = src; src = dst; dst = t;					\
+    }									\
+									\
+  for (i = 0; i < n; ++i)						\
+    a[i] = from_key (src[i]);						\
+  pfree (v->pool, tmp);							\
+}
+
+/* Signed integers: flip the sign bit. */
+static inline uint32_t _int_key_32 (uint32_t u) { return u ^ 0x80000000; }
+static inline uint64_t _int_key_64 (uint64_t u) { return u ^ 0x8000000000000000ULL; }
+
+/* Floating point: flip all the bits of negative numbers, and the
+ * sign bit of the rest.
+ */
+static inline uint32_t
+_float_to_key_32 (uint32_t u)
+{
+  return u ^ (-(u >> 31) | 0x80000000);
+}
+
+static inline uint32_t
+_float_from_key_32 (uint32_t u)
+{
+  return u ^ (((u >> 31) - 1) | 0x80000000);
+}
+
+static inline uint64_t
+_float_to_key_64 (uint64_t u)
+{
+  return u ^ (-(u >> 63) | 0x8000000000000000ULL);
+}
+
+static inline uint64_t
+_float_from_key_64 (uint64_t u)
+{
+  return u ^ (((u >> 63) - 1) | 0x8000000000000000ULL);
+}
+
+RADIX_SORT (_vector_radix_sort_int_32, uint32_t, _int_key_32, _int_key_32)
+RADIX_SORT (_vector_radix_sort_int_64, uint64_t, _int_key_64, _int_key_64)
+RADIX_SORT (_vector_radix_sort_float_32, uint32_t,
+	    _float_to_key_32, _float_from_key_32)
+RADIX_SORT (_vector_radix_sort_float_64, uint64_t,
+	    _float_to_key_64, _float_from_key_64)
+
+#define _vector_less(a,b) ((a) < (b))
+VECTOR_DEFINE_SORT (int_small, int, _vector_less)
+VECTOR_DEFINE_SORT (long_small, long, _vector_less)
+VECTOR_DEFINE_SORT (float_small, float, _vector_less)
+VECTOR_DEFINE_SORT (double_small, double, _vector_less)
+
+/* Below this size, an insertion or quick sort is faster than making
+ * the radix sort's passes.
+ */
+#define RADIX_MIN 256
+
+void
+vector_int_sort (vector v)
+{
+  assert (v->size == sizeof (int) && sizeof (int) == 4);
+  assert (!vector_is_view (v));
+
+  if (v->used < RADIX_MIN)
+    vector_int_small_sort (v);
+  else
+    _vector_radix_sort_int_32 (v);
+}
+
+void
+vector_long_sort (vector v)
+{
+  assert (v->size == sizeof (long));
+  assert (!vector_is_view (v));
+
+  if (v->used < RADIX_MIN)
+    vector_long_small_sort (v);
+  else if (sizeof (long) == 4)
+    _vector_radix_sort_int_32 (v);
+  else
+    _vector_radix_sort_int_64 (v);
+}
+
+/* The small sorts would order NaNs arbitrarily, so they are only used
+ * when there are no NaNs.
+ */
+void
+vector_float_sort (vector v)
+{
+  float *a = v->data;
+  int i;
+
+  assert (v->size == sizeof (float) && sizeof (float) == 4);
+  assert (!vector_is_view (v));
+
+  if (v->used < RADIX_MIN)
+    {
+      for (i = 0; i < v->used; ++i)
+	if (a[i] != a[i])
+	  break;
+      if (i == v->used)
+	{
+	  vector_float_small_sort (v);
+	  return;
+	}
+    }
+  _vector_radix_sort_float_32 (v);
+}
+
+void
+vector_double_sort (vector v)
+{
+  double *a = v->data;
+  int i;
+
+  assert (v->size == sizeof (double) && sizeof (double) == 8);
+  assert (!vector_is_view (v));
+
+  if (v->used < RADIX_MIN)
+    {
+      for (i = 0; i < v->used; ++i)
+	if (a[i] != a[i])
+	  break;
+      if (i == v->used)
+	{
+	  vector_double_small_sort (v);
+	  return;
+	}
+    }
+  _vector_radix_sort_float_64 (v);
+}
+
+#define _vector_str_less(a,b) (strcmp ((a), (b)) < 0)
+VECTOR_DEFINE_SORT (str_intro, char *, _vector_str_less)
+
+void
+vector_str_sort (vector v)
+{
+  vector_str_intro_sort (v);
+}
+
+int
+_vector_lower_bound (vector v, const void *key,
+		     int (*compare_fn) (const void *, const void *))
+{
+  int lo = 0, hi = v->used, mid;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (compare_fn (key, v->data + mid * v->size) > 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
+
+int
+_vector_upper_bound (vector v, const void *key,
+		     int (*compare_fn) (const void *, const void *))
+{
+  int lo = 0, hi = v->used, mid;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (compare_fn (key, v->data + mid * v->size) >= 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
+
+int
+_vector_bsearch (vector v, const void *key,
+		 int (*compare_fn) (const void *, const void *))
+{
+  int i = _vector_lower_bound (v, key, compare_fn);
+
+  if (i < v->used && compare_fn (key, v->data + i * v->size) == 0)
+    return i;
+  return -1;
+}
+
+int
+_vector_insert_sorted (vector v, const void *ptr,
+		       int (*compare_fn) (const void *, const void *))
+{
+  int i = _vector_upper_bound (v, ptr, compare_fn);
+
+  vector_insert_array (v, i, ptr, 1);
+  return i;
+}
+
+/* Append elements [i, j) of w to v. */
+static inline void
+_vector_append (vector v, vector w, int i, int j)
+{
+  if (i < j)
+    {
+      memcpy (v->data + v->used * v->size, w->data + i * w->size,
+	      (j - i) * w->size);
+      v->used += j - i;
+    }
+}
+
+vector
+_vector_union (pool p, vector v1, vector v2,
+	       int (*compare_fn) (const void *, const void *))
+{
+  vector nv = _vector_new (p, v1->size);
+  int i = 0, j = 0, r;
+
+  assert (v1->size == v2->size);
+  vector_reserve (nv, v1->used + v2->used);
+
+  while (i < v1->used && j < v2->used)
+    {
+      r = compare_fn (v1->data + i * v1->size, v2->data + j * v2->size);
+      if (r <= 0) _vector_append (nv, v1, i, i+1), i++;
+      else _vector_append (nv, v2, j, j+1), j++;
+      if (r == 0) j++;
+    }
+  _vector_append (nv, v1, i, v1->used);
+  _vector_append (nv, v2, j, v2->used);
+
+  return nv;
+}
+
+vector
+_vector_intersection (pool p, vector v1, vector v2,
+		      int (*compare_fn) (const void *, const void *))
+{
+  vector nv = _vector_new (p, v1->size);
+  int i = 0, j = 0, r;
+
+  assert (v1->size == v2->size);
+  vector_reserve (nv, v1->used < v2->used ? v1->used : v2->used);
+
+  while (i < v1->used && j < v2->used)
+    {
+      r = compare_fn (v1->data + i * v1->size, v2->data + j * v2->size);
+      if (r < 0) i++;
+      else if (r > 0) j++;
+      else
+	{
+	  _vector_append (nv, v1, i, i+1);
+	  i++, j++;
+	}
+    }
+
+  return nv;
+}
+
+/* The k-way merge keeps a binary heap of the vectors which still have
+ * elements, ordered by their next element and then by their position
+ * in vs, so that the merge is stable.
+ */
+struct _vector_merge_state
+{
+  vector *vs;
+  int *next;
+  int (*compare_fn) (const void *, const void *);
+};
+
+static inline int
+_vector_merge_less (struct _vector_merge_state *s, int a, int b)
+{
+  int r = s->compare_fn (s->vs[a]->data + s->next[a] * s->vs[a]->size,
+			 s->vs[b]->data + s->next[b] * s->vs[b]->size);
+
+  return r < 0 || (r == 0 && a < b);
+}
+
+static void
+_vector_merge_sift_down (struct _vector_merge_state *s, int *heap,
+			 int i, int n)
+{
+  int c, t = heap[i];
+
+  while ((c = 2*i + 1) < n)
+    {
+      if (c+1 < n && _vector_merge_less (s, heap[c+1], heap[c])) c++;
+      if (!_vector_merge_less (s, heap[c], t)) break;
+      heap[i] = heap[c];
+      i = c;
+    }
+  heap[i] = t;
+}
+
+vector
+_vector_merge (pool p, vector *vs, int n,
+	       int (*compare_fn) (const void *, const void *))
+{
+  struct _vector_merge_state s;
+  vector nv, v;
+  int heap[n > 0 ? n : 1], next[n > 0 ? n : 1];
+  int i, nr = 0, total = 0;
+
+  assert (n > 0);
+  for (i = 0; i < n; ++i)
+    {
+      assert (vs[i]->size == vs[0]->size);
+      total += vs[i]->used;
+      next[i] = 0;
+      if (vs[i]->used > 0)
+	heap[nr++] = i;
+    }
+
+  nv = _vector_new (p, vs[0]->size);
+  vector_reserve (nv, total);
+
+  s.vs = vs;
+  s.next = next;
+  s.compare_fn = compare_fn;
+  for (i = nr/2 - 1; i >= 0; --i)
+    _vector_merge_sift_down (&s, heap, i, nr);
+
+  while (nr > 0)
+    {
+      v = vs[heap[0]];
+      _vector_append (nv, v, next[heap[0]], next[heap[0]] + 1);
+      if (++next[heap[0]] == v->used)
+	heap[0] = heap[--nr];
+      _vector_merge_sift_down (&s, heap, 0, nr);
+    }
+
+  return nv;
 }
 
 int
@@ -261,8 +897,12 @@ _vector_compare (vector v1, vector v2,
 void
 _vector_fill (vector v, const void *ptr, int n)
 {
+  _vector_grow (v, v->used + n);
   while (n--)
-    _vector_push_back (v, ptr);
+    {
+      memcpy (v->data + v->used * v->size, ptr, v->size);
+      v->used++;
+    }
 }
 
 void
@@ -271,6 +911,7 @@ vector_swap (vector v, int i, int j)
   void *pi, *pj;
   char data[v->size];
 
+  assert (!vector_is_view (v));
   if (i == j) return;
 
   vector_get_ptr (v, i, pi);
@@ -282,13 +923,50 @@ vector_swap (vector v, int i, int j)
 }
 
 void
-vector_reallocate (vector v, int n)
+vector_reserve (vector v, int n)
 {
+  assert (!vector_is_view (v));
   if (n > v->allocated)
     {
-      void *d = prealloc (v->pool, v->data, n * v->size);
+      void *d = _vector_realloc (v, (v->start + n) * v->size);
       v->allocated = n;
+      v->data = d + v->start * v->size;
+    }
+}
+
+void
+vector_reallocate (vector v, int n)
+{
+  vector_reserve (v, n);
+}
+
+/* One element is always kept, so that the data of an aligned vector
+ * stays aligned when it grows again.
+ */
+void
+vector_shrink_to_fit (vector v)
+{
+  int n = v->used > 0 ? v->used : 1;
+  int align = v->flags >> VECTOR_ALIGN_SHIFT;
+  void *d;
+
+  assert (!vector_is_view (v));
+  _vector_compact (v);
+  if (v->data && n < v->allocated && !(v->flags & VECTOR_INLINE))
+    {
+      /* prealloc never shrinks a small block, so move the elements to
+       * a block of the right size and give the old one back to the
+       * pool, which can then reuse it for another allocation. An
+       * aligned vector gets a block with the same alignment.
+       */
+      if (align)
+	d = pmalloc_aligned (v->pool, n * v->size, (size_t) 1 << align);
+      else
+	d = pmalloc (v->pool, n * v->size);
+      memcpy (d, v->data, v->used * v->size);
+      pfree (v->pool, v->data);
       v->data = d;
+      v->allocated = n;
     }
 }
 
@@ -326,7 +1004,7 @@ _vector_map (pool p, vector v,
   vector nv = _vector_new (p, result_size);
   int i;
 
-  vector_reallocate (nv, v->used);
+  vector_reserve (nv, v->used);
   nv->used = v->used;
 
   for (i = 0; i < v->used; ++i)
@@ -343,7 +1021,7 @@ _vector_map_pool (pool p, vector v,
   vector nv = _vector_new (p, result_size);
   int i;
 
-  vector_reallocate (nv, v->used);
+  vector_reserve (nv, v->used);
   nv->used = v->used;
 
   for (i = 0; i < v->used; ++i)
@@ -351,3 +1029,366 @@ _vector_map_pool (pool p, vector v,
 
   return nv;
 }
+
+/* Parallel map and grep. The input is split into chunks of
+ * PARALLEL_CHUNK elements, which the calling thread and up to
+ * nr_threads-1 worker threads take in turn.
+ */
+#define PARALLEL_CHUNK 16384
+
+static int nr_threads = 0;	/* 0 means one per online CPU. */
+
+struct _vector_job
+{
+  pool pool;
+  vector v, nv;
+  void (*map_fn) (const void *, void *);
+  void (*map_fn_pool) (pool, const void *, void *);
+  int (*match_fn) (const void *);
+  int (*match_fn_pool) (pool, const void *);
+  void (*chunk_fn) (struct _vector_job *, int chunk);
+  char *matches;		/* grep: result of match_fn per element. */
+  int *offset;			/* grep: count, then offset per chunk. */
+  int nr_chunks;
+  int next_chunk;
+};
+
+/* The worker threads are started the first time a job needs them and
+ * then kept, waiting on work_cond for the next job, so that a call
+ * does not pay for creating threads. job_lock is held by the thread
+ * running a job for the whole of it. A call which finds the workers
+ * busy, such as a parallel map called from inside another, runs in
+ * the calling thread only. The other variables are protected by
+ * workers_lock. Each job increments job_serial, and worker i takes
+ * part in it if i < nr_helpers.
+ */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t workers_once = PTHREAD_ONCE_INIT;
+static pthread_t *workers;
+static int nr_workers, workers_exit;
+static struct _vector_job *current_job;
+static unsigned long job_serial;
+static int nr_helpers, nr_busy;
+
+static void
+_vector_do_chunks (struct _vector_job *job)
+{
+  int chunk;
+
+  while ((chunk = __atomic_fetch_add (&job->next_chunk, 1, __ATOMIC_RELAXED))
+	 < job->nr_chunks)
+    job->chunk_fn (job, chunk);
+}
+
+static void *
+_vector_worker (void *arg)
+{
+  int id = (long) arg;
+  unsigned long seen = 0;
+  struct _vector_job *job;
+
+  pthread_mutex_lock (&workers_lock);
+  for (;;)
+    {
+      while (!workers_exit && seen == job_serial)
+	pthread_cond_wait (&work_cond, &workers_lock);
+      if (workers_exit)
+	break;
+      seen = job_serial;
+      if (id >= nr_helpers)
+	continue;
+
+      job = current_job;
+      pthread_mutex_unlock (&workers_lock);
+      _vector_do_chunks (job);
+      pthread_mutex_lock (&workers_lock);
+      if (--nr_busy == 0)
+	pthread_cond_signal (&done_cond);
+    }
+  pthread_mutex_unlock (&workers_lock);
+
+  return 0;
+}
+
+/* Stop the worker threads. Called with job_lock held. */
+static void
+_vector_stop_workers (void)
+{
+  int i;
+
+  pthread_mutex_lock (&workers_lock);
+  workers_exit = 1;
+  pthread_cond_broadcast (&work_cond);
+  pthread_mutex_unlock (&workers_lock);
+
+  for (i = 0; i < nr_workers; ++i)
+    pthread_join (workers[i], 0);
+  nr_workers = 0;
+  workers_exit = 0;
+}
+
+/* The workers do not exist in a child process. */
+static void
+_vector_workers_atfork_child (void)
+{
+  pthread_mutex_init (&job_lock, 0);
+  pthread_mutex_init (&workers_lock, 0);
+  pthread_cond_init (&work_cond, 0);
+  pthread_cond_init (&done_cond, 0);
+  nr_workers = 0;
+}
+
+static void
+_vector_workers_init (void)
+{
+  pthread_atfork (0, 0, _vector_workers_atfork_child);
+}
+
+/* Make sure there are at least n workers, as far as possible. Called
+ * with both locks held. A new worker has not seen any job yet, so it
+ * takes part in the current one.
+ */
+static void
+_vector_start_workers (int n)
+{
+  pthread_t *w;
+
+  if (n <= nr_workers)
+    return;
+  pthread_once (&workers_once, _vector_workers_init);
+  w = realloc (workers, n * sizeof (pthread_t));
+  if (w == 0)
+    return;
+  workers = w;
+  while (nr_workers < n &&
+	 pthread_create (&workers[nr_workers], 0, _vector_worker,
+			 (void *) (long) nr_workers) == 0)
+    ++nr_workers;
+}
+
+int
+vector_set_threads (int n)
+{
+  int old;
+
+  assert (n >= 0);
+  pthread_mutex_lock (&job_lock);
+  old = nr_threads;
+  nr_threads = n;
+  /* The next job starts as many workers as it needs. */
+  if (n != old)
+    _vector_stop_workers ();
+  pthread_mutex_unlock (&job_lock);
+
+  return old;
+}
+
+/* Decide how many threads to use for nr_chunks chunks. */
+static int
+_vector_nr_threads (int nr_chunks)
+{
+  int n = nr_threads;
+
+  if (n == 0)
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+      n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+      if (n < 1) n = 1;
+    }
+  if (n > nr_chunks) n = nr_chunks;
+  if (n < 1) n = 1;
+
+  return n;
+}
+
+/* Run job->chunk_fn on every chunk of job->v. */
+static void
+_vector_parallel (struct _vector_job *job)
+{
+  int n;
+
+  job->next_chunk = 0;
+  n = _vector_nr_threads (job->nr_chunks) - 1;
+  if (n == 0 || pthread_mutex_trylock (&job_lock) != 0)
+    {
+      _vector_do_chunks (job);
+      return;
+    }
+
+  pthread_mutex_lock (&workers_lock);
+  current_job = job;
+  ++job_serial;
+  _vector_start_workers (n);
+  if (n > nr_workers) n = nr_workers;
+  nr_helpers = nr_busy = n;
+  pthread_cond_broadcast (&work_cond);
+  pthread_mutex_unlock (&workers_lock);
+
+  _vector_do_chunks (job);
+
+  pthread_mutex_lock (&workers_lock);
+  while (nr_busy > 0)
+    pthread_cond_wait (&done_cond, &workers_lock);
+  pthread_mutex_unlock (&workers_lock);
+  pthread_mutex_unlock (&job_lock);
+}
+
+static void
+_vector_map_chunk (struct _vector_job *job, int chunk)
+{
+  vector v = job->v, nv = job->nv;
+  int i = chunk * PARALLEL_CHUNK, end = i + PARALLEL_CHUNK;
+
+  if (end > v->used) end = v->used;
+  if (job->map_fn)
+    for (; i < end; ++i)
+      job->map_fn (v->data + i * v->size, nv->data + i * nv->size);
+  else
+    for (; i < end; ++i)
+      job->map_fn_pool (job->pool,
+			v->data + i * v->size, nv->data + i * nv->size);
+}
+
+static vector
+_vector_map_job (struct _vector_job *job, size_t result_size)
+{
+  job->nv = _vector_new (job->pool, result_size);
+  vector_reserve (job->nv, job->v->used);
+  job->nv->used = job->v->used;
+
+  job->nr_chunks = (job->v->used + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+  job->chunk_fn = _vector_map_chunk;
+  _vector_parallel (job);
+
+  return job->nv;
+}
+
+vector
+_vector_map_parallel (pool p, vector v,
+		      void (*map_fn) (const void *, void *),
+		      size_t result_size)
+{
+  struct _vector_job job;
+
+  memset (&job, 0, sizeof job);
+  job.pool = p;
+  job.v = v;
+  job.map_fn = map_fn;
+
+  return _vector_map_job (&job, result_size);
+}
+
+vector
+_vector_map_pool_parallel (pool p, vector v,
+			   void (*map_fn) (pool, const void *, void *),
+			   size_t result_size)
+{
+  struct _vector_job job;
+
+  memset (&job, 0, sizeof job);
+  job.pool = p;
+  job.v = v;
+  job.map_fn_pool = map_fn;
+
+  return _vector_map_job (&job, result_size);
+}
+
+/* First pass of grep: run the match function over the chunk,
+ * remembering the results and counting the matches.
+ */
+static void
+_vector_grep_count_chunk (struct _vector_job *job, int chunk)
+{
+  vector v = job->v;
+  int i = chunk * PARALLEL_CHUNK, end = i + PARALLEL_CHUNK, count = 0;
+
+  if (end > v->used) end = v->used;
+  for (; i < end; ++i)
+    {
+      job->matches[i] = job->match_fn
+	? job->match_fn (v->data + i * v->size) != 0
+	: job->match_fn_pool (job->pool, v->data + i * v->size) != 0;
+      count += job->matches[i];
+    }
+  job->offset[chunk] = count;
+}
+
+/* Second pass: copy the matching elements of the chunk to their place
+ * in the result.
+ */
+static void
+_vector_grep_scatter_chunk (struct _vector_job *job, int chunk)
+{
+  vector v = job->v, nv = job->nv;
+  int i = chunk * PARALLEL_CHUNK, end = i + PARALLEL_CHUNK;
+  char *dst = nv->data + job->offset[chunk] * nv->size;
+
+  if (end > v->used) end = v->used;
+  for (; i < end; ++i)
+    if (job->matches[i])
+      {
+	memcpy (dst, v->data + i * v->size, v->size);
+	dst += v->size;
+      }
+}
+
+static vector
+_vector_grep_job (struct _vector_job *job)
+{
+  vector v = job->v;
+  int i, total, count;
+
+  job->nr_chunks = (v->used + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+  job->matches = pmalloc (job->pool, v->used + 1);
+  job->offset = pmalloc (job->pool, (job->nr_chunks + 1) * sizeof (int));
+  job->chunk_fn = _vector_grep_count_chunk;
+  _vector_parallel (job);
+
+  for (i = 0, total = 0; i < job->nr_chunks; ++i)
+    {
+      count = job->offset[i];
+      job->offset[i] = total;
+      total += count;
+    }
+
+  job->nv = _vector_new (job->pool, v->size);
+  vector_reserve (job->nv, total);
+  job->nv->used = total;
+  job->chunk_fn = _vector_grep_scatter_chunk;
+  _vector_parallel (job);
+
+  pfree (job->pool, job->matches);
+  pfree (job->pool, job->offset);
+  return job->nv;
+}
+
+vector
+vector_grep_parallel (pool p, vector v, int (*match_fn) (const void *))
+{
+  struct _vector_job job;
+
+  memset (&job, 0, sizeof job);
+  job.pool = p;
+  job.v = v;
+  job.match_fn = match_fn;
+
+  return _vector_grep_job (&job);
+}
+
+vector
+vector_grep_pool_parallel (pool p, vector v,
+			   int (*match_fn) (pool, const void *))
+{
+  struct _vector_job job;
+
+  memset (&job, 0, sizeof job);
+  job.pool = p;
+  job.v = v;
+  job.match_fn_pool = match_fn;
+
+  return _vector_grep_job (&job);
+}
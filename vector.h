@@ -21,6 +21,8 @@
 #ifndef VECTOR_H
 #define VECTOR_H
 
+#include <assert.h>
+
 #include <pool.h>
 
 struct vector
@@ -29,20 +31,64 @@ struct vector
   size_t size;
   void *data;
   int used, allocated;
+  int start;			/* Free elements in front of data. */
+  int flags;
 };
 
+#define VECTOR_VIEW 0x1		/* Data belongs to something else. */
+#define VECTOR_INLINE 0x2	/* Data is stored inside the owner. */
+#define VECTOR_ALIGN_SHIFT 8	/* Above this, log2 of the alignment. */
+
 typedef struct vector *vector;
 
 /* Function: new_vector - allocate a new vector
  * Function: _vector_new
+ * Function: new_vector_aligned
+ * Function: _vector_new_aligned
  *
  * Allocate a new vector in @code{pool} of type @code{type}. The
  * first form is just a macro which evaluates the size of @code{type}.
  * The second form creates a vector with elements of the given
  * @code{size} directly.
+ *
+ * @code{new_vector_aligned} and @code{_vector_new_aligned} create
+ * a vector whose data is always aligned to @code{align} bytes (a
+ * power of two), even after the vector grows, using
+ * @ref{pmalloc_aligned(3)}. This allows the data to be loaded directly
+ * with aligned SIMD instructions. Copies of the vector made with
+ * @ref{copy_vector(3)} or @ref{new_subvector(3)} are not aligned.
  */
 #define new_vector(pool,type) _vector_new ((pool), sizeof (type))
 extern vector _vector_new (pool, size_t size);
+#define new_vector_aligned(pool,type,align) _vector_new_aligned ((pool), sizeof (type), (align))
+extern vector _vector_new_aligned (pool, size_t size, size_t align);
+
+/* Function: new_vector_inline - allocate a new vector with room for a few elements built in
+ * Function: _vector_new_inline
+ * Function: _vector_init_inline
+ *
+ * A vector normally needs two allocations: one for the vector
+ * structure, and another for the elements when the first one is
+ * added. @code{new_vector_inline} allocates the structure together
+ * with room for @code{n} elements of type @code{type}, so that a
+ * vector which never grows beyond @code{n} elements costs a single
+ * allocation. If it does grow beyond @code{n}, the elements move to
+ * a separate allocation in the pool, just as for an ordinary vector,
+ * and the inline space is no longer used. @code{_vector_new_inline}
+ * is the same, with the element size given directly.
+ *
+ * This suits the many small vectors used as hash buckets, for the
+ * subnodes of trees and so on. The result is an ordinary vector and
+ * may be used with all the other vector functions.
+ *
+ * @code{_vector_init_inline} initialises a @code{struct vector}
+ * @code{v} which is part of a larger structure, so that it uses
+ * @code{storage} (room for @code{n} elements of @code{size} bytes,
+ * which must last as long as @code{v}) until it outgrows it.
+ */
+#define new_vector_inline(pool,type,n) _vector_new_inline ((pool), sizeof (type), (n))
+extern vector _vector_new_inline (pool, size_t size, int n);
+extern void _vector_init_inline (vector v, pool, size_t size, void *storage, int n);
 
 /* Function: copy_vector - copy a vector
  * Function: new_subvector
@@ -59,6 +105,44 @@ extern vector _vector_new (pool, size_t size);
 extern vector copy_vector (pool, vector v);
 extern vector new_subvector (pool, vector v, int i, int j);
 
+/* Function: new_vector_view - make a vector which refers to existing data
+ * Function: _vector_new_view
+ * Function: new_subvector_view
+ * Function: vector_is_view
+ *
+ * A view is a vector whose elements are not copied, but belong to
+ * another vector or to an array. Creating one takes constant time
+ * however many elements it covers: only the vector structure itself
+ * is allocated in @code{pool}.
+ *
+ * @code{new_vector_view} makes a view of the @code{n} objects of type
+ * @code{type} in the array starting at @code{ptr}.
+ * @code{_vector_new_view} is the same, with the element size given
+ * directly.
+ *
+ * @code{new_subvector_view} makes a view of the elements of vector
+ * @code{v} from @code{v[i]} up to (but not including) @code{v[j]}.
+ * This is like @ref{new_subvector(3)} without the copy.
+ *
+ * Views can be passed to any function which only reads a vector,
+ * such as @ref{vector_get(3)}, @ref{vector_compare(3)},
+ * @ref{vector_map(3)}, @ref{vector_grep(3)}, @ref{vector_bsearch(3)},
+ * @ref{pjoin(3)}, or as the source of @ref{copy_vector(3)} or
+ * @ref{vector_push_back_vector(3)}. To sort or change the elements,
+ * make a copy with @ref{copy_vector(3)} first. Functions which change
+ * a vector @code{assert} that it is not a view.
+ *
+ * A view is only valid while the data it refers to is: a view of a
+ * vector must not be used after anything is added to or removed from
+ * that vector.
+ *
+ * @code{vector_is_view} returns true if @code{v} is a view.
+ */
+#define new_vector_view(pool,type,ptr,n) _vector_new_view ((pool), sizeof (type), (ptr), (n))
+extern vector _vector_new_view (pool, size_t size, const void *ptr, int n);
+extern vector new_subvector_view (pool, vector v, int i, int j);
+#define vector_is_view(v) ((v)->flags & VECTOR_VIEW)
+
 /* Function: vector_push_back - push and pop objects into and out of vectors
  * Function: _vector_push_back
  * Function: vector_pop_back
@@ -73,12 +157,17 @@ extern vector new_subvector (pool, vector v, int i, int j);
  * The @code{*_pop_*} functions pop objects off vectors into local variables.
  *
  * The @code{*_front} functions push and pop objects off the front
- * of a vector. This type of operation is not very efficient, because
- * it involves moving all other elements of the vector up or down
- * by one place.
- *
- * The @code{*_back} functions push and pop elements
- * off the end of the vector, which is efficient.
+ * of a vector. The @code{*_back} functions push and pop elements
+ * off the end of the vector.
+ *
+ * All of these take amortized constant time, so a vector can be used
+ * as a queue or a deque. The elements are always stored contiguously:
+ * popping from the front leaves free space before the first element,
+ * which is reused by later pushes onto the front, or (once it is
+ * as large as the vector) by pushes onto the back. Elements pushed
+ * onto the front of an aligned vector (see
+ * @ref{new_vector_aligned(3)}) and elements following elements popped
+ * off the front are not necessarily aligned.
  *
  * Each function has two forms: a macro version and an underlying
  * function.
@@ -144,12 +233,15 @@ extern const void *_vector_get_ptr (vector, int i);
  * Function: vector_insert_array
  *
  * @code{vector_insert} inserts a single object @code{obj} before element
- * @code{i}. All other elements are moved up to make space.
+ * @code{i}. The other elements are moved to make space.
  *
  * @code{vector_insert_array} inserts an array of @code{n} objects
  * starting at address @code{ptr} into the vector before index
  * @code{i}.
  *
+ * Whichever of the elements before or after @code{i} are fewer are
+ * moved, so inserting near either end of a vector is cheap.
+ *
  * Array indexes are checked.
  */
 #define vector_insert(v,i,obj) _vector_insert((v),(i),&(obj))
@@ -178,11 +270,13 @@ extern void vector_replace_array (vector v, int i, const void *ptr, int n);
  * Function: vector_clear
  *
  * @code{vector_erase} removes the element @code{v[i]}, shuffling
- * the later elements down by one place to fill the space.
+ * the later elements down (or the earlier elements up) by one place
+ * to fill the space.
  *
  * @code{vector_erase_range} removes a range of elements @code{v[i]}
  * to @code{v[j-1]} (@code{i <= j}), shuffling later elements down
- * to fill the space.
+ * (or, if there are fewer of them, earlier elements up) to fill the
+ * space.
  *
  * @code{vector_clear} removes all elements from the vector, setting
  * its size to @code{0}.
@@ -198,7 +292,8 @@ extern void vector_clear (vector v);
  *
  * @code{vector_fill} appends @code{n} identical copies of
  * @code{obj} to the vector. It is equivalent to calling
- * @ref{vector_push_back(3)} in a loop @code{n} times.
+ * @ref{vector_push_back(3)} in a loop @code{n} times, but grows
+ * the vector only once.
  */
 #define vector_fill(v,obj,n) _vector_fill((v),&(obj),(n))
 extern void _vector_fill (vector, const void *ptr, int n);
@@ -225,15 +320,40 @@ extern void _vector_fill (vector, const void *ptr, int n);
  */
 #define vector_element_size(v) ((v)->size)
 
-/* Function: vector_reallocate - change allocation for a vector
+/* Function: vector_reserve - change allocation for a vector
+ * Function: vector_reallocate
+ * Function: vector_shrink_to_fit
+ * Function: vector_set_growth
  *
- * Increase the amount of space allocated to a vector. See also
+ * @code{vector_reserve} increases the amount of space allocated to
+ * a vector to at least @code{n} elements. See also
  * @ref{vector_allocated(3)}. This function can be used to avoid
  * the vector itself making too many calls to the underlying
  * @ref{prealloc(3)}, particularly if you know in advance exactly
- * how many elements the vector will contain.
+ * how many elements the vector will contain. Space which has been
+ * reserved is used by all the functions which add elements,
+ * including @ref{vector_insert_array(3)}, @ref{vector_fill(3)} and
+ * @ref{vector_push_back_vector(3)}. @code{vector_reallocate} is the
+ * old name for this function.
+ *
+ * @code{vector_shrink_to_fit} moves the elements to a block of the
+ * right size and gives the old block back to the pool, which can reuse
+ * it for later allocations. The data of an aligned vector stays
+ * aligned.
+ *
+ * When a vector runs out of space, its allocation is multiplied by a
+ * growth factor, so that building a vector one element at a time
+ * takes amortized constant time per element. The factor is a
+ * percentage, by default @code{200} (ie. the allocation doubles).
+ * @code{vector_set_growth} changes it for all vectors, and returns
+ * the previous setting. @code{percent} must be greater than
+ * @code{100}. Smaller factors waste less memory but reallocate more
+ * often.
  */
+extern void vector_reserve (vector v, int n);
 extern void vector_reallocate (vector v, int n);
+extern void vector_shrink_to_fit (vector v);
+extern int vector_set_growth (int percent);
 
 /* Function: vector_grep - produce a new vector containing elements of the old vector which match a boolean function
  *
@@ -271,6 +391,52 @@ extern vector _vector_map (pool, vector v, void (*map_fn) (const void *, void *)
 #define vector_map_pool(pool,v,map_fn,result_type) _vector_map_pool ((pool), (v), (map_fn), sizeof (result_type))
 extern vector _vector_map_pool (pool, vector v, void (*map_fn_pool) (pool, const void *, void *), size_t result_size);
 
+/* Function: vector_map_parallel - apply function to each element of a vector using several threads
+ * Function: _vector_map_parallel
+ * Function: vector_map_pool_parallel
+ * Function: _vector_map_pool_parallel
+ * Function: vector_grep_parallel
+ * Function: vector_grep_pool_parallel
+ * Function: vector_set_threads
+ *
+ * These functions do the same as @ref{vector_map(3)},
+ * @ref{vector_map_pool(3)}, @ref{vector_grep(3)} and
+ * @ref{vector_grep_pool(3)}, and return the same results in the same
+ * order, but split the vector into chunks which are processed by
+ * several threads at once. The calling thread takes part, and waits
+ * until all the chunks are done. They are worthwhile for vectors of
+ * many thousands of elements, or where the function is slow.
+ *
+ * The map functions write each result directly into the new vector.
+ * The grep functions run @code{match_fn} over the whole vector first,
+ * counting the matches in each chunk, then copy the matching
+ * elements, so no locking is needed.
+ *
+ * @code{map_fn} and @code{match_fn} are called from several threads
+ * at once, in no particular order. If they allocate from the pool
+ * they are passed, the pool must have the @code{POOL_CONCURRENT} flag
+ * (see @ref{pool_set_flags(3)}).
+ *
+ * The extra threads are started by the first call which needs them
+ * and kept for later calls. One call at a time uses them. A call made
+ * while they are busy, for example from inside @code{map_fn}, runs
+ * in the calling thread only.
+ *
+ * @code{vector_set_threads} sets the largest number of threads used
+ * (including the calling thread), and returns the previous setting.
+ * The default, @code{0}, means one thread per online CPU.
+ * @code{1} makes these functions run in the calling thread only.
+ * Changing the setting stops the existing threads. It must not be
+ * called from @code{map_fn} or @code{match_fn}.
+ */
+#define vector_map_parallel(pool,v,map_fn,result_type) _vector_map_parallel ((pool), (v), (map_fn), sizeof (result_type))
+extern vector _vector_map_parallel (pool, vector v, void (*map_fn) (const void *, void *), size_t result_size);
+#define vector_map_pool_parallel(pool,v,map_fn,result_type) _vector_map_pool_parallel ((pool), (v), (map_fn), sizeof (result_type))
+extern vector _vector_map_pool_parallel (pool, vector v, void (*map_fn_pool) (pool, const void *, void *), size_t result_size);
+extern vector vector_grep_parallel (pool, vector v, int (*match_fn) (const void *));
+extern vector vector_grep_pool_parallel (pool, vector v, int (*match_fn) (pool, const void *));
+extern int vector_set_threads (int n);
+
 /* Function: vector_sort - sort a vector in-place
  * Function: _vector_sort
  *
@@ -279,6 +445,244 @@ extern vector _vector_map_pool (pool, vector v, void (*map_fn_pool) (pool, const
 #define vector_sort(v,compare_fn) _vector_sort ((v), (int (*)(const void *,const void *)) (compare_fn))
 extern void _vector_sort (vector v, int (*compare_fn) (const void *, const void *));
 
+/* Function: vector_stable_sort - sort a vector in-place, keeping the order of equal elements
+ * Function: _vector_stable_sort
+ *
+ * Sort a vector in-place, comparing elements using @code{compare_fn}.
+ * Unlike @ref{vector_sort(3)}, elements which compare equal stay in
+ * the order they were in before the sort. This uses a merge sort,
+ * which needs temporary space in the vector's pool as large as the
+ * vector.
+ */
+#define vector_stable_sort(v,compare_fn) _vector_stable_sort ((v), (int (*)(const void *,const void *)) (compare_fn))
+extern void _vector_stable_sort (vector v, int (*compare_fn) (const void *, const void *));
+
+/* Function: vector_int_sort - sort a vector of numbers in-place
+ * Function: vector_long_sort
+ * Function: vector_float_sort
+ * Function: vector_double_sort
+ * Function: vector_str_sort
+ *
+ * Sort a vector of @code{int}, @code{long}, @code{float},
+ * @code{double} or @code{char *} into ascending order, in-place.
+ *
+ * The numeric sorts are LSD radix sorts, which take time linear in
+ * the size of the vector and need temporary space in the vector's
+ * pool as large as the vector. They are stable. Negative zero sorts
+ * before positive zero, and NaNs sort to the start (if their sign
+ * bit is set) or the end.
+ *
+ * @code{vector_str_sort} sorts strings into @code{strcmp} order,
+ * using the sort defined by @ref{VECTOR_DEFINE_SORT(3)}.
+ */
+extern void vector_int_sort (vector v);
+extern void vector_long_sort (vector v);
+extern void vector_float_sort (vector v);
+extern void vector_double_sort (vector v);
+extern void vector_str_sort (vector v);
+
+/* Function: VECTOR_DEFINE_SORT - define a sort with an inlined comparison
+ *
+ * @ref{vector_sort(3)} calls the comparison function through a
+ * pointer for every comparison. @code{VECTOR_DEFINE_SORT(name,type,less)}
+ * instead defines @code{static inline void vector_name_sort (vector v)}
+ * for vectors whose elements have type @code{type}, where
+ * @code{less(a,b)} is a macro or inline function which is true if
+ * element @code{a} (of type @code{type}) sorts before @code{b}. For
+ * example:
+ *
+ * @code{#define point_less(a,b) ((a).x < (b).x)}
+ *
+ * @code{VECTOR_DEFINE_SORT (point, struct point, point_less)}
+ *
+ * The sort is an introsort: a quicksort with median of three pivots,
+ * which finishes small ranges with an insertion sort, and falls back
+ * to a heapsort if it partitions badly, so it is never worse than
+ * O(n log n). It is not stable.
+ *
+ * It also defines @code{_vector_name_sort_array (type *a, int n)},
+ * which sorts a plain array.
+ */
+#define VECTOR_DEFINE_SORT(name,type,less)				\
+static inline void							\
+_vector_##name##_insertion_sort (type *a, int n)			\
+{									\
+  int i, j;								\
+  type t;								\
+									\
+  for (i = 1; i < n; ++i)						\
+    {									\
+      t = a[i];								\
+      for (j = i; j > 0 && less (t, a[j-1]); --j)			\
+	a[j] = a[j-1];							\
+      a[j] = t;								\
+    }									\
+}									\
+static inline void							\
+_vector_##name##_sift_down (type *a, int i, int n)			\
+{									\
+  int c;								\
+  type t = a[i];							\
+									\
+  while ((c = 2*i + 1) < n)						\
+    {									\
+      if (c+1 < n && less (a[c], a[c+1])) c++;				\
+      if (!less (t, a[c])) break;					\
+      a[i] = a[c];							\
+      i = c;								\
+    }									\
+  a[i] = t;								\
+}									\
+static inline void							\
+_vector_##name##_heap_sort (type *a, int n)				\
+{									\
+  int i;								\
+  type t;								\
+									\
+  for (i = n/2 - 1; i >= 0; --i)					\
+    _vector_##name##_sift_down (a, i, n);				\
+  for (i = n-1; i > 0; --i)						\
+    {									\
+      t = a[0]; a[0] = a[i]; a[i] = t;					\
+      _vector_##name##_sift_down (a, 0, i);				\
+    }									\
+}									\
+static inline void							\
+_vector_##name##_sort_array (type *a, int n)				\
+{									\
+  int i, j, m, depth = 0;						\
+  type p;								\
+  type t;								\
+									\
+  for (i = n; i > 1; i >>= 1) depth += 2;				\
+									\
+  while (n > 16)							\
+    {									\
+      if (depth-- == 0)							\
+	{								\
+	  _vector_##name##_heap_sort (a, n);				\
+	  return;							\
+	}								\
+									\
+      /* Order the first, middle and last elements, so that the	\
+       * first and last stop the scans below.				\
+       */								\
+      m = n / 2;							\
+      if (less (a[m], a[0])) { t = a[m]; a[m] = a[0]; a[0] = t; }	\
+      if (less (a[n-1], a[m]))						\
+	{								\
+	  t = a[m]; a[m] = a[n-1]; a[n-1] = t;				\
+	  if (less (a[m], a[0])) { t = a[m]; a[m] = a[0]; a[0] = t; }	\
+	}								\
+      p = a[m];								\
+									\
+      i = 0; j = n-1;							\
+      for (;;)								\
+	{								\
+	  do i++; while (less (a[i], p));				\
+	  do j--; while (less (p, a[j]));				\
+	  if (i >= j) break;						\
+	  t = a[i]; a[i] = a[j]; a[j] = t;				\
+	}								\
+									\
+      /* Recurse into the smaller part and loop on the larger. */	\
+      if (i < n - i)							\
+	{								\
+	  _vector_##name##_sort_array (a, i);				\
+	  a += i;							\
+	  n -= i;							\
+	}								\
+      else								\
+	{								\
+	  _vector_##name##_sort_array (a + i, n - i);			\
+	  n = i;							\
+	}								\
+    }									\
+  _vector_##name##_insertion_sort (a, n);				\
+}									\
+static inline void							\
+vector_##name##_sort (vector v)						\
+{									\
+  assert (v->size == sizeof (type) && !vector_is_view (v));		\
+  _vector_##name##_sort_array ((type *) v->data, v->used);		\
+}
+
+/* Function: vector_bsearch - search a sorted vector
+ * Function: _vector_bsearch
+ * Function: vector_lower_bound
+ * Function: _vector_lower_bound
+ * Function: vector_upper_bound
+ * Function: _vector_upper_bound
+ * Function: vector_insert_sorted
+ * Function: _vector_insert_sorted
+ *
+ * These functions work on a vector which is sorted into the order
+ * given by @code{compare_fn} (for example by @ref{vector_sort(3)}),
+ * taking O(log n) comparisons. @code{compare_fn} is called with a
+ * pointer to @code{key} and a pointer to an element. The key need not
+ * be the same type as the elements, so long as @code{compare_fn}
+ * knows how to compare them.
+ *
+ * @code{vector_bsearch} returns the index of an element which
+ * compares equal to @code{key}, or @code{-1} if there is none.
+ *
+ * @code{vector_lower_bound} returns the index of the first element
+ * which is not less than @code{key}, and @code{vector_upper_bound}
+ * the index of the first element which is greater than @code{key}.
+ * Either is @code{vector_size(v)} if there is no such element. The
+ * elements equal to @code{key} are those from the lower bound up to
+ * (but not including) the upper bound.
+ *
+ * @code{vector_insert_sorted} inserts @code{obj} after any equal
+ * elements, so that the vector stays sorted, and returns its index.
+ *
+ * A sorted vector of (key, value) structures makes a compact map for
+ * data which is read much more often than it changes: it uses less
+ * memory than a hash and is read with @code{vector_bsearch}.
+ */
+#define vector_bsearch(v,key,compare_fn) _vector_bsearch ((v), &(key), (int (*)(const void *,const void *)) (compare_fn))
+extern int _vector_bsearch (vector v, const void *key, int (*compare_fn) (const void *, const void *));
+#define vector_lower_bound(v,key,compare_fn) _vector_lower_bound ((v), &(key), (int (*)(const void *,const void *)) (compare_fn))
+extern int _vector_lower_bound (vector v, const void *key, int (*compare_fn) (const void *, const void *));
+#define vector_upper_bound(v,key,compare_fn) _vector_upper_bound ((v), &(key), (int (*)(const void *,const void *)) (compare_fn))
+extern int _vector_upper_bound (vector v, const void *key, int (*compare_fn) (const void *, const void *));
+#define vector_insert_sorted(v,obj,compare_fn) _vector_insert_sorted ((v), &(obj), (int (*)(const void *,const void *)) (compare_fn))
+extern int _vector_insert_sorted (vector v, const void *ptr, int (*compare_fn) (const void *, const void *));
+
+/* Function: vector_union - combine sorted vectors
+ * Function: _vector_union
+ * Function: vector_intersection
+ * Function: _vector_intersection
+ * Function: vector_merge
+ * Function: _vector_merge
+ *
+ * These functions take vectors which are sorted into the order given
+ * by @code{compare_fn}, and return a new sorted vector allocated in
+ * @code{pool}. The input vectors are unchanged. They take time linear
+ * in the total size of the inputs (times @code{log n} for
+ * @code{vector_merge}).
+ *
+ * @code{vector_union} returns the elements which are in either
+ * @code{v1} or @code{v2}. An element which occurs in both is copied
+ * from @code{v1} only. If an element occurs several times, the result
+ * contains it as many times as whichever vector has more of it.
+ *
+ * @code{vector_intersection} returns the elements of @code{v1} which
+ * are also in @code{v2}. If an element occurs several times, the
+ * result contains it as many times as whichever vector has fewer
+ * of it.
+ *
+ * @code{vector_merge} merges the @code{n} vectors in the array
+ * @code{vs} into one, keeping every element. Equal elements stay in
+ * the order of the vectors they came from.
+ */
+#define vector_union(pool,v1,v2,compare_fn) _vector_union ((pool), (v1), (v2), (int (*)(const void *,const void *)) (compare_fn))
+extern vector _vector_union (pool, vector v1, vector v2, int (*compare_fn) (const void *, const void *));
+#define vector_intersection(pool,v1,v2,compare_fn) _vector_intersection ((pool), (v1), (v2), (int (*)(const void *,const void *)) (compare_fn))
+extern vector _vector_intersection (pool, vector v1, vector v2, int (*compare_fn) (const void *, const void *));
+#define vector_merge(pool,vs,n,compare_fn) _vector_merge ((pool), (vs), (n), (int (*)(const void *,const void *)) (compare_fn))
+extern vector _vector_merge (pool, vector *vs, int n, int (*compare_fn) (const void *, const void *));
+
 /* Function: vector_compare - compare two vectors
  * Function: _vector_compare
  *
@@ -301,4 +705,86 @@ extern void vector_reverse (vector v);
  */
 extern void vector_swap (vector v, int i, int j);
 
+/* Function: VECTOR_DEFINE_TYPED - define typed inline accessors for vectors
+ * Function: vector_int_get
+ * Function: vector_int_set
+ * Function: vector_int_push_back
+ * Function: vector_int_pop_back
+ * Function: vector_int_data
+ *
+ * The generic functions above copy elements with @code{memcpy} of
+ * @code{vector_element_size} bytes, through a function call. For
+ * vectors of small types used in inner loops, that costs more than
+ * the work itself. @code{VECTOR_DEFINE_TYPED(name,type)} defines a
+ * set of @code{static inline} functions for vectors whose elements
+ * have type @code{type}, which the compiler can reduce to ordinary
+ * loads and stores:
+ *
+ * @code{type vector_name_get (vector v, int i)} returns @code{v[i]}.
+ *
+ * @code{void vector_name_set (vector v, int i, type obj)} replaces
+ * @code{v[i]} with @code{obj}.
+ *
+ * @code{void vector_name_push_back (vector v, type obj)} pushes
+ * @code{obj} on to the end of the vector. Only growing the vector
+ * goes through the generic @ref{vector_push_back(3)}.
+ *
+ * @code{type vector_name_pop_back (vector v)} pops and returns the
+ * last element.
+ *
+ * @code{type *vector_name_data (vector v)} returns a pointer to the
+ * first element, with the same lifetime as @ref{vector_get_ptr(3)}.
+ *
+ * Accessors are already defined for @code{int}, @code{long},
+ * @code{float}, @code{double} and @code{void *} (as @code{vector_int_*},
+ * @code{vector_long_*}, @code{vector_float_*}, @code{vector_double_*}
+ * and @code{vector_ptr_*}). They work on any vector created with
+ * @code{new_vector} of the same type, and may be mixed freely with
+ * the generic functions. Array indexes and the element size are
+ * checked with @code{assert}, so they are only unchecked when
+ * compiled with @code{NDEBUG}.
+ */
+#define VECTOR_DEFINE_TYPED(name,type)					\
+static inline type							\
+vector_##name##_get (vector v, int i)					\
+{									\
+  assert (v->size == sizeof (type) && 0 <= i && i < v->used);		\
+  return ((type *) v->data)[i];						\
+}									\
+static inline void							\
+vector_##name##_set (vector v, int i, type obj)				\
+{									\
+  assert (v->size == sizeof (type) && 0 <= i && i < v->used);		\
+  assert (!vector_is_view (v));						\
+  ((type *) v->data)[i] = obj;						\
+}									\
+static inline void							\
+vector_##name##_push_back (vector v, type obj)				\
+{									\
+  assert (v->size == sizeof (type));					\
+  if (v->used < v->allocated)						\
+    ((type *) v->data)[v->used++] = obj;				\
+  else									\
+    _vector_push_back (v, &obj);					\
+}									\
+static inline type							\
+vector_##name##_pop_back (vector v)					\
+{									\
+  assert (v->size == sizeof (type) && v->used > 0);			\
+  assert (!vector_is_view (v));						\
+  return ((type *) v->data)[--v->used];					\
+}									\
+static inline type *							\
+vector_##name##_data (vector v)						\
+{									\
+  assert (v->size == sizeof (type));					\
+  return (type *) v->data;						\
+}
+
+VECTOR_DEFINE_TYPED (int, int)
+VECTOR_DEFINE_TYPED (long, long)
+VECTOR_DEFINE_TYPED (float, float)
+VECTOR_DEFINE_TYPED (double, double)
+VECTOR_DEFINE_TYPED (ptr, void *)
+
 #endif /* VECTOR_H */